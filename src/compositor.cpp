@@ -0,0 +1,132 @@
+#include "compositor.h"
+
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define COMPOSITOR_SSE2 1
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// x / 255 rounded to nearest, exact for every x up to 255 * 255
+inline uint32_t Div255(uint32_t x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+template <bool Premultiplied>
+inline olc::Pixel BlendPixel(olc::Pixel dst, olc::Pixel src)
+{
+    const uint32_t alpha = src.a;
+    const uint32_t inverse = 255 - alpha;
+    if (!Premultiplied)
+    {
+        src.r = uint8_t(Div255(src.r * alpha));
+        src.g = uint8_t(Div255(src.g * alpha));
+        src.b = uint8_t(Div255(src.b * alpha));
+    }
+    return olc::Pixel(
+        uint8_t(src.r + Div255(dst.r * inverse)),
+        uint8_t(src.g + Div255(dst.g * inverse)),
+        uint8_t(src.b + Div255(dst.b * inverse)),
+        uint8_t(alpha + Div255(dst.a * inverse)));
+}
+
+#ifdef COMPOSITOR_SSE2
+
+// Same as Div255 on eight 16 bit lanes
+inline __m128i Div255(__m128i x)
+{
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+// Two pixels widened to 16 bit lanes, blended with their alpha broadcast to every lane of the pixel
+template <bool Premultiplied>
+inline __m128i BlendHalf(__m128i dst, __m128i src)
+{
+    const __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(src, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    if (!Premultiplied)
+    {
+        // Color lanes are scaled by alpha, the alpha lane by 255 which leaves it as it is
+        const __m128i colorLanes = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+        const __m128i factor = _mm_or_si128(_mm_and_si128(alpha, colorLanes), _mm_andnot_si128(colorLanes, _mm_set1_epi16(255)));
+        src = Div255(_mm_mullo_epi16(src, factor));
+    }
+    const __m128i inverse = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+    return _mm_add_epi16(src, Div255(_mm_mullo_epi16(dst, inverse)));
+}
+
+template <bool Premultiplied>
+void BlendRow(olc::Pixel* target, const olc::Pixel* source, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128i src = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+
+        // Layers are mostly empty, four transparent pixels leave the target as it is
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_srli_epi32(src, 24), zero)) == 0xffff) continue;
+
+        __m128i* dstPtr = reinterpret_cast<__m128i*>(target + i);
+        const __m128i dst = _mm_loadu_si128(dstPtr);
+        const __m128i low = BlendHalf<Premultiplied>(_mm_unpacklo_epi8(dst, zero), _mm_unpacklo_epi8(src, zero));
+        const __m128i high = BlendHalf<Premultiplied>(_mm_unpackhi_epi8(dst, zero), _mm_unpackhi_epi8(src, zero));
+        _mm_storeu_si128(dstPtr, _mm_packus_epi16(low, high));
+    }
+
+    for (; i < count; i++)
+    {
+        if (source[i].a != 0) target[i] = BlendPixel<Premultiplied>(target[i], source[i]);
+    }
+}
+
+#else
+
+template <bool Premultiplied>
+void BlendRow(olc::Pixel* target, const olc::Pixel* source, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (source[i].a != 0) target[i] = BlendPixel<Premultiplied>(target[i], source[i]);
+    }
+}
+
+#endif // COMPOSITOR_SSE2
+
+} // namespace
+
+void Compositor::BlendOver(olc::Pixel* target, const olc::Pixel* source, int count)
+{
+    BlendRow<false>(target, source, count);
+}
+
+void Compositor::BlendOverPremultiplied(olc::Pixel* target, const olc::Pixel* source, int count)
+{
+    BlendRow<true>(target, source, count);
+}
+
+void Compositor::BlendOver(olc::Sprite* target, olc::Sprite* source, const PixelRect& rect)
+{
+    const SpriteView targetView(target);
+    const SpriteView sourceView(source);
+    for (int y = rect.yMin; y < rect.yMax; y++)
+    {
+        BlendOver(targetView.Row(y) + rect.xMin, sourceView.Row(y) + rect.xMin, rect.xMax - rect.xMin);
+    }
+}
+
+void Compositor::Unpremultiply(olc::Pixel* pixels, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        olc::Pixel& p = pixels[i];
+        if (p.a == 0 || p.a == 255) continue;
+
+        auto fnChannel = [&](uint8_t c) { return uint8_t(std::min((c * 255u + p.a / 2u) / p.a, 255u)); };
+        p = olc::Pixel(fnChannel(p.r), fnChannel(p.g), fnChannel(p.b), p.a);
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "shaper.h"
+
+// Flattens layers with the "over" operator. The flattened image is kept with premultiplied
+// alpha, which makes every blend dst = src + dst * (255 - src.a) / 255 on all four channels.
+// Rows are blended with integer SIMD where available, dividing by 255 exactly with rounding,
+// and every path produces the same bytes as the scalar fallback.
+class Compositor {
+public:
+    // Blends count pixels with straight alpha over premultiplied target pixels
+    static void BlendOver(olc::Pixel* target, const olc::Pixel* source, int count);
+
+    // Blends count premultiplied pixels over premultiplied target pixels
+    static void BlendOverPremultiplied(olc::Pixel* target, const olc::Pixel* source, int count);
+
+    // Blends rect of a layer surface over a premultiplied sprite of the same size
+    static void BlendOver(olc::Sprite* target, olc::Sprite* source, const PixelRect& rect);
+
+    // Turns count premultiplied pixels back into straight alpha, in place
+    static void Unpremultiply(olc::Pixel* pixels, size_t count);
+};
@@ -41,6 +41,22 @@ bool History::CanRedo() const
     return !mRedoStack.empty();
 }
 
+// Only the area covered by the element before and after the change needs to be re-rendered. A
+// new join can change which element starts the shape, which reaches beyond the element.
+static void ApplyParams(Layer* layer, Element* element, const ElementParams& params)
+{
+    if (params.joinOperation != element->GetJoinOperation())
+    {
+        element->SetParams(params);
+        layer->Invalidate();
+        return;
+    }
+
+    PixelRect oldBounds = layer->GetElementBounds(element);
+    element->SetParams(params);
+    layer->Invalidate(oldBounds.Union(layer->GetElementBounds(element)));
+}
+
 void CmdChangeProperty::Execute()
 {
     Layer* layer = mRef.drawing->GetLayer(mRef.layerId);
@@ -50,7 +66,7 @@ void CmdChangeProperty::Execute()
     if (!element) return;
 
     mOldParams = element->GetParams();
-    element->SetParams(mNewParams);
+    ApplyParams(layer, element, mNewParams);
 }
 
 void CmdChangeProperty::Undo()
@@ -61,7 +77,7 @@ void CmdChangeProperty::Undo()
     Element* element = layer->GetElement(mRef.elementId);
     if (!element) return;
 
-    element->SetParams(mOldParams);
+    ApplyParams(layer, element, mOldParams);
 }
 
 void CmdAddElement::Execute()
@@ -69,23 +85,8 @@ void CmdAddElement::Execute()
     Layer* layer = mRef.drawing->GetLayer(mRef.layerId);
     if (!layer) return;
 
-    std::string type = mParams["type"];
-    Element* element = nullptr;
-    if (type == "ellipse")
-    {
-        element = new EllipseElement();
-    }
-    else if (type == "rectangle")
-    {
-        element = new RectangleElement();
-    }
-    else if (type == "triangle")
-    {
-        element = new TriangleElement();
-    }
-
+    Element* element = Primitives::Deserialize(mParams);
     if (element) {
-        element->Deserialize(mParams);
         mRef.elementId = layer->AddElement(element)->GetID();
     }
 }
@@ -119,23 +120,8 @@ void CmdDeleteElement::Undo()
     Layer* layer = mRef.drawing->GetLayer(mRef.layerId);
     if (!layer) return;
 
-    Element* element = nullptr;
-    std::string type = mParams["type"];
-    if (type == "ellipse")
-    {
-        element = new EllipseElement();
-    }
-    else if (type == "rectangle")
-    {
-        element = new RectangleElement();
-    }
-    else if (type == "triangle")
-    {
-        element = new TriangleElement();
-    }
-
+    Element* element = Primitives::Deserialize(mParams);
     if (element) {
-        element->Deserialize(mParams);
         mRef.elementId = layer->AddElement(element)->GetID();
     }
 }
@@ -163,6 +149,7 @@ void CmdEffectEnable::Execute()
 
     mOldState = effect->mEnabled;
     effect->mEnabled = mEnable;
+    layer->Invalidate();
 }
 
 void CmdEffectEnable::Undo()
@@ -174,6 +161,7 @@ void CmdEffectEnable::Undo()
     if (!effect) return;
 
     effect->mEnabled = mOldState;
+    layer->Invalidate();
 }
 
 void CmdChangeMergeSmoothness::Execute()
@@ -203,6 +191,7 @@ void CmdChangeEffectProperty::Execute()
 
     // Apply new properties
     effect->Deserialize(mNewParams);
+    layer->Invalidate();
 }
 
 void CmdChangeEffectProperty::Undo()
@@ -214,6 +203,7 @@ void CmdChangeEffectProperty::Undo()
     if (!effect) return;
 
     effect->Deserialize(mOldParams);
+    layer->Invalidate();
 }
 
 void CmdAddLayer::Execute()
@@ -0,0 +1,207 @@
+#include "image_writer.h"
+
+#include "png_encoder.h"
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <vector>
+
+namespace {
+
+// PAM with its header, or the bare RGBA bytes. olc::Pixel is stored as RGBA bytes, so rows
+// go to the stream as they are.
+class PamWriter : public ImageWriter {
+public:
+    PamWriter(std::ostream& out, int width, int height, bool header)
+        : mOut(out), mWidth(width), mRowsLeft(height)
+    {
+        if (header)
+        {
+            mOut << "P7\nWIDTH " << width << "\nHEIGHT " << height << "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+        }
+    }
+
+    bool WriteRows(const olc::Pixel* rows, int count) override
+    {
+        if (count < 0 || count > mRowsLeft) return false;
+        mRowsLeft -= count;
+        mOut.write(reinterpret_cast<const char*>(rows), std::streamsize(size_t(count) * mWidth * 4));
+        return bool(mOut);
+    }
+
+    bool Finish() override
+    {
+        mOut.flush();
+        return mRowsLeft == 0 && mOut.good();
+    }
+
+private:
+    std::ostream& mOut;
+    int mWidth, mRowsLeft;
+};
+
+// The Quite OK Image format: every pixel is a run of the one before, a hit in a table of recently
+// seen colors, a small difference to the one before, or given in full
+class QoiWriter : public ImageWriter {
+public:
+    QoiWriter(std::ostream& out, int width, int height)
+        : mOut(out), mWidth(width), mRowsLeft(height)
+    {
+        // Magic, size, 4 channels and sRGB with linear alpha
+        const uint8_t header[14] = {
+            'q', 'o', 'i', 'f',
+            uint8_t(width >> 24), uint8_t(width >> 16), uint8_t(width >> 8), uint8_t(width),
+            uint8_t(height >> 24), uint8_t(height >> 16), uint8_t(height >> 8), uint8_t(height),
+            4, 0
+        };
+        mOut.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+        // The table starts out transparent black, which olc::Pixel does not default to
+        std::fill_n(mIndex, 64, olc::Pixel(0, 0, 0, 0));
+    }
+
+    bool WriteRows(const olc::Pixel* rows, int count) override
+    {
+        if (count < 0 || count > mRowsLeft) return false;
+        mRowsLeft -= count;
+
+        // Five bytes at most per pixel, and the rows are encoded in one go
+        const size_t pixels = size_t(count) * mWidth;
+        mBuffer.resize(pixels * 5);
+        uint8_t* out = mBuffer.data();
+
+        for (size_t i = 0; i < pixels; i++)
+        {
+            const olc::Pixel p = rows[i];
+            if (p == mPrevious)
+            {
+                if (++mRun == 62)
+                {
+                    *out++ = uint8_t(0xc0 | (mRun - 1));
+                    mRun = 0;
+                }
+                continue;
+            }
+
+            if (mRun > 0)
+            {
+                *out++ = uint8_t(0xc0 | (mRun - 1));
+                mRun = 0;
+            }
+
+            const int hash = (p.r * 3 + p.g * 5 + p.b * 7 + p.a * 11) % 64;
+            if (mIndex[hash] == p)
+            {
+                *out++ = uint8_t(hash);
+            }
+            else
+            {
+                mIndex[hash] = p;
+
+                const int dr = int8_t(p.r - mPrevious.r);
+                const int dg = int8_t(p.g - mPrevious.g);
+                const int db = int8_t(p.b - mPrevious.b);
+                const int drg = dr - dg, dbg = db - dg;
+                if (p.a != mPrevious.a)
+                {
+                    *out++ = 0xff;
+                    *out++ = p.r;
+                    *out++ = p.g;
+                    *out++ = p.b;
+                    *out++ = p.a;
+                }
+                else if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+                {
+                    *out++ = uint8_t(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+                }
+                else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7)
+                {
+                    *out++ = uint8_t(0x80 | (dg + 32));
+                    *out++ = uint8_t((drg + 8) << 4 | (dbg + 8));
+                }
+                else
+                {
+                    *out++ = 0xfe;
+                    *out++ = p.r;
+                    *out++ = p.g;
+                    *out++ = p.b;
+                }
+            }
+            mPrevious = p;
+        }
+
+        mOut.write(reinterpret_cast<const char*>(mBuffer.data()), out - mBuffer.data());
+        return bool(mOut);
+    }
+
+    bool Finish() override
+    {
+        if (mRun > 0)
+        {
+            const uint8_t run = uint8_t(0xc0 | (mRun - 1));
+            mOut.write(reinterpret_cast<const char*>(&run), 1);
+            mRun = 0;
+        }
+
+        const uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+        mOut.write(reinterpret_cast<const char*>(end), sizeof(end));
+        mOut.flush();
+        return mRowsLeft == 0 && mOut.good();
+    }
+
+private:
+    std::ostream& mOut;
+    int mWidth, mRowsLeft;
+
+    olc::Pixel mPrevious{ 0, 0, 0, 255 };
+    olc::Pixel mIndex[64];
+    int mRun{ 0 };
+    std::vector<uint8_t> mBuffer;
+};
+
+} // namespace
+
+ImageFormat ImageFormatFromPath(const std::string& path)
+{
+    std::string extension = std::filesystem::path(path).extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+
+    if (extension == ".qoi") return ImageFormat::QOI;
+    if (extension == ".pam") return ImageFormat::PAM;
+    if (extension == ".rgba" || extension == ".raw") return ImageFormat::Raw;
+    return ImageFormat::PNG;
+}
+
+bool ImageFormatFromName(const std::string& name, ImageFormat& format)
+{
+    if (name == "png") format = ImageFormat::PNG;
+    else if (name == "qoi") format = ImageFormat::QOI;
+    else if (name == "pam") format = ImageFormat::PAM;
+    else if (name == "raw" || name == "rgba") format = ImageFormat::Raw;
+    else return false;
+    return true;
+}
+
+std::unique_ptr<ImageWriter> ImageWriter::Create(ImageFormat format, std::ostream& out, int width, int height,
+    int level, ThreadPool* workers)
+{
+    switch (format)
+    {
+        case ImageFormat::PNG:
+#ifdef PIXELSHAPER_ZLIB
+            return std::make_unique<PngEncoder>(out, width, height, level, workers);
+#else
+            (void)level;
+            (void)workers;
+            return nullptr;
+#endif
+        case ImageFormat::QOI:
+            return std::make_unique<QoiWriter>(out, width, height);
+        case ImageFormat::PAM:
+            return std::make_unique<PamWriter>(out, width, height, true);
+        case ImageFormat::Raw:
+            return std::make_unique<PamWriter>(out, width, height, false);
+    }
+    return nullptr;
+}
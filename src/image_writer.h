@@ -0,0 +1,39 @@
+#pragma once
+
+#include "olcPixelGameEngine.h"
+#include "thread_pool.h"
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+
+enum class ImageFormat : uint8_t {
+    PNG,
+    QOI,
+    PAM,
+    Raw
+};
+
+// Format for an output path by its extension: .qoi, .pam, .rgba or .raw, anything else is PNG
+ImageFormat ImageFormatFromPath(const std::string& path);
+
+// Format by name as given on the command line, false if there is no such format
+bool ImageFormatFromName(const std::string& name, ImageFormat& format);
+
+// Writes an image of straight alpha RGBA pixels to a stream, row by row from top to bottom
+class ImageWriter {
+public:
+    virtual ~ImageWriter() = default;
+
+    // Adds count rows. Returns false once anything failed to be written.
+    virtual bool WriteRows(const olc::Pixel* rows, int count) = 0;
+
+    // Ends the image, once every row was written
+    virtual bool Finish() = 0;
+
+    // Writer for a width x height image, which starts with writing the header. level is the zlib
+    // level of PNG, workers compress PNG in parallel. PNG needs zlib, without it this returns null.
+    static std::unique_ptr<ImageWriter> Create(ImageFormat format, std::ostream& out, int width, int height,
+        int level, ThreadPool* workers = nullptr);
+};
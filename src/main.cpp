@@ -8,9 +8,12 @@
 #include "gui.h"
 #include "shaper.h"
 #include "history.h"
+#include "render_thread.h"
+#include "compositor.h"
 
 #include <regex>
 #include <fstream>
+#include <iostream>
 #include <filesystem>
 #include <sstream>
 #include <iomanip>
@@ -57,6 +60,7 @@ public:
         gui.AddIcon("assets/triangle.png"); // 20
 
         mHistory = std::make_unique<History>();
+        mRenderer = std::make_unique<RenderThread>();
 
         RecreateDrawing();
 
@@ -123,7 +127,7 @@ public:
         if (gui.CutLeft(22).Button("add_ellipse", "$[2]", controlColor))
         {
             json params = {
-                {"type", "ellipse"},
+                {"type", EllipseElement::Name},
                 {"position", {mDrawing->GetWidth() / 2, mDrawing->GetHeight() / 2}},
                 {"size", {40, 40}},
                 {"rotation", 0.0f},
@@ -131,14 +135,14 @@ public:
             };
 
             mHistory->Push(new CmdAddElement({ mDrawing.get(), activeLayer->GetID(), 0 }, params));
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
 
         // Rectangle
         if (gui.CutLeft(22).Button("add_rectangle", "$[3]", controlColor))
         {
             json params = {
-                {"type", "rectangle"},
+                {"type", RectangleElement::Name},
                 {"position", {mDrawing->GetWidth() / 2, mDrawing->GetHeight() / 2}},
                 {"size", {40, 40}},
                 {"rotation", 0.0f},
@@ -146,14 +150,14 @@ public:
             };
 
             mHistory->Push(new CmdAddElement({ mDrawing.get(), activeLayer->GetID(), 0 }, params));
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
 
         // Triangle
         if (gui.CutLeft(22).Button("add_triangle", "$[20]", controlColor))
         {
             json params = {
-                {"type", "triangle"},
+                {"type", TriangleElement::Name},
                 {"position", {mDrawing->GetWidth() / 2, mDrawing->GetHeight() / 2}},
                 {"size", {40, 40}},
                 {"rotation", 0.0f},
@@ -161,7 +165,7 @@ public:
             };
 
             mHistory->Push(new CmdAddElement({ mDrawing.get(), activeLayer->GetID(), 0 }, params));
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
 
         gui.CutLeft(6).Spacer();
@@ -180,13 +184,13 @@ public:
             mHistory->Push(new CmdAddElement({ mDrawing.get(), activeLayer->GetID(), 0 }, params));
             selectedElement = mDrawing->GetLayer(activeLayer->GetID())->GetElements().back();
 
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
         if (gui.CutLeft(22).Button("delete", "$[18]", controlColor, selectedElement != nullptr))
         {
             mHistory->Push(new CmdDeleteElement(currentElement()));
             selectedElement = nullptr;
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
 
         gui.CutLeft(6).Spacer();
@@ -196,7 +200,7 @@ public:
         {
             mHistory->Undo();
             selectedElement = nullptr;
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
 
         w = 25;
@@ -204,7 +208,7 @@ public:
         {
             mHistory->Redo();
             selectedElement = nullptr;
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
 
         gui.CutLeft(6).Spacer();
@@ -226,7 +230,7 @@ public:
         if (layers.size() < 10) { // limit to 10 layers
             if (gui.CutTop(18).Button("add_layer", "$[8] Add Layer", controlColor)) {
                 mHistory->Push(new CmdAddLayer({ mDrawing.get(), 0 }, json()));
-                mDrawing->RenderAll();
+                mRenderer->Submit(*mDrawing);
                 activeLayer = mDrawing->GetLayers().back();
             }
         }
@@ -253,7 +257,7 @@ public:
 
                     activeLayer = mDrawing->GetLayers().front();
 
-                    mDrawing->RenderAll();
+                    mRenderer->Submit(*mDrawing);
                     break;
                 }
             }
@@ -268,7 +272,7 @@ public:
                 ))
                 {
                     mHistory->Push(new CmdMoveLayerUp({ mDrawing.get(), layer->GetID() }));
-                    mDrawing->RenderAll();
+                    mRenderer->Submit(*mDrawing);
                 }
             }
 
@@ -281,7 +285,7 @@ public:
                 ))
                 {
                     mHistory->Push(new CmdMoveLayerDown({ mDrawing.get(), layer->GetID() }));
-                    mDrawing->RenderAll();
+                    mRenderer->Submit(*mDrawing);
                 }
             }
 
@@ -302,12 +306,12 @@ public:
         if (gui.CutLeft(0.5f).Spinner("drawing_width", drawingWidth, 8, 512, 2, controlColor))
         {
             mHistory->Push(new CmdChangeDrawingSize(mDrawing.get(), { drawingWidth, drawingHeight }));
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
         if (gui.CutRight(1.0f).Spinner("drawing_height", drawingHeight, 8, 512, 2, controlColor))
         {
             mHistory->Push(new CmdChangeDrawingSize(mDrawing.get(), { drawingWidth, drawingHeight }));
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
         gui.Spacer();
         gui.CutBottom(18).Text("Drawing Size", Alignment::Left, olc::BLACK);
@@ -319,7 +323,7 @@ public:
             activeLayer->SetMergeSmoothness(smoothness / 100.0f);
             if (GetMouse(0).bReleased)
                 mHistory->Push(new CmdChangeMergeSmoothness({ mDrawing.get(), activeLayer->GetID() }, smoothness / 100.0f));
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
         gui.CutBottom(18).Text("Merge Smoothness", Alignment::Left, olc::BLACK);
     }
@@ -333,20 +337,21 @@ public:
             return;
         }
 
+        // Spinners edit a copy, so the command sees the element as it was before the edit
+        ElementParams params = selectedElement->GetParams();
+
         // Position
         gui.CutTop(18).Text("Position", Alignment::Left, olc::BLACK);
         gui.CutTop(18);
-        if (gui.CutLeft(0.5f).Spinner("pos_x", selectedElement->mPosition.x, -999, 999, 1, controlColor))
+        if (gui.CutLeft(0.5f).Spinner("pos_x", params.position.x, -999, 999, 1, controlColor))
         {
-            auto params = selectedElement->GetParams();
             mHistory->Push(new CmdChangeProperty(currentElement(), params));
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
-        if (gui.CutRight(1.0f).Spinner("pos_y", selectedElement->mPosition.y, -999, 999, 1, controlColor))
+        if (gui.CutRight(1.0f).Spinner("pos_y", params.position.y, -999, 999, 1, controlColor))
         {
-            auto params = selectedElement->GetParams();
             mHistory->Push(new CmdChangeProperty(currentElement(), params));
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
         gui.Spacer();
 
@@ -355,17 +360,15 @@ public:
         // Size
         gui.CutTop(18).Text("Size", Alignment::Left, olc::BLACK);
         gui.CutTop(18);
-        if (gui.CutLeft(0.5f).Spinner("size_x", selectedElement->mSize.x, 1, 1000, 1, controlColor))
+        if (gui.CutLeft(0.5f).Spinner("size_x", params.size.x, 1, 1000, 1, controlColor))
         {
-            auto params = selectedElement->GetParams();
             mHistory->Push(new CmdChangeProperty(currentElement(), params));
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
-        if (gui.CutRight(1.0f).Spinner("size_y", selectedElement->mSize.y, 1, 1000, 1, controlColor))
+        if (gui.CutRight(1.0f).Spinner("size_y", params.size.y, 1, 1000, 1, controlColor))
         {
-            auto params = selectedElement->GetParams();
             mHistory->Push(new CmdChangeProperty(currentElement(), params));
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
         gui.Spacer();
 
@@ -376,10 +379,9 @@ public:
         gui.CutTop(18);
         if (gui.Spinner("rotation", selectedElementRotation, -180, 180, 1, controlColor))
         {
-            selectedElement->mRotation = static_cast<float>(selectedElementRotation) * M_PI / 180.0f;
-            auto params = selectedElement->GetParams();
+            params.rotation = static_cast<float>(selectedElementRotation) * M_PI / 180.0f;
             mHistory->Push(new CmdChangeProperty(currentElement(), params));
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
 
         // Color
@@ -389,13 +391,14 @@ public:
         gui.CutTop(100);
         if (gui.ColorPicker("element_color", selectedElement->mColor))
         {
-            mDrawing->RenderAll();
+            activeLayer->Invalidate(activeLayer->GetElementBounds(selectedElement));
+            mRenderer->Submit(*mDrawing);
             UpdateHTMLColor();
         }
 
         if (gui.WasClicked("element_color"))
         {
-            auto params = selectedElement->GetParams();
+            params = selectedElement->GetParams();
             mHistory->Push(new CmdChangeProperty(currentElement(), params));
         }
 
@@ -409,12 +412,11 @@ public:
         }, controlColor))
         {
             if (std::sscanf(selectedElementHtmlColor.c_str(), "#%02hhx%02hhx%02hhx%02hhx",
-                &selectedElement->mColor.r, &selectedElement->mColor.g,
-                &selectedElement->mColor.b, &selectedElement->mColor.a) == 4)
+                &params.color.r, &params.color.g,
+                &params.color.b, &params.color.a) == 4)
             {
-                auto params = selectedElement->GetParams();
                 mHistory->Push(new CmdChangeProperty(currentElement(), params));
-                mDrawing->RenderAll();
+                mRenderer->Submit(*mDrawing);
             }
         }
 
@@ -429,10 +431,9 @@ public:
         int mode = static_cast<int>(selectedElement->mJoinOp);
         if (gui.TabBar(joinTypes, mode, controlColor, true))
         {
-            auto params = selectedElement->GetParams();
             params.joinOperation = static_cast<JoinOperation>(mode);
             mHistory->Push(new CmdChangeProperty(currentElement(), params));
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
         gui.Spacer();
     }
@@ -462,7 +463,7 @@ public:
             if (gui.CheckBox("fx_contour_enabled", "Enabled", wasContourEnabled, olc::WHITE, olc::BLACK))
             {
                 mHistory->Push(new CmdEffectEnable(currentLayer(), LayerEffectType::ContourEffect, wasContourEnabled));
-                mDrawing->RenderAll();
+                mRenderer->Submit(*mDrawing);
             }
 
             if (activeLayer->GetContourEffect()->mEnabled)
@@ -471,7 +472,8 @@ public:
                 gui.CutTop(100);
                 if (gui.ColorPicker("fx_contour_color", activeLayer->GetContourEffect()->mColor))
                 {
-                    mDrawing->RenderAll();
+                    activeLayer->Invalidate();
+                    mRenderer->Submit(*mDrawing);
                 }
 
                 if (gui.WasClicked("fx_contour_color"))
@@ -485,7 +487,7 @@ public:
                         }}
                     };
                     mHistory->Push(new CmdChangeEffectProperty(currentLayer(), LayerEffectType::ContourEffect, params));
-                    mDrawing->RenderAll();
+                    mRenderer->Submit(*mDrawing);
                 }
 
                 gui.CutTop(18).Text("Thickness", Alignment::Left, olc::BLACK);
@@ -496,7 +498,7 @@ public:
                         {"thickness", activeLayer->GetContourEffect()->mThickness}
                     };
                     mHistory->Push(new CmdChangeEffectProperty(currentLayer(), LayerEffectType::ContourEffect, params));
-                    mDrawing->RenderAll();
+                    mRenderer->Submit(*mDrawing);
                 }
             }
         }
@@ -508,7 +510,7 @@ public:
             if (gui.CheckBox("fx_shading_enabled", "Enabled", wasShadingEnabled, olc::WHITE, olc::BLACK))
             {
                 mHistory->Push(new CmdEffectEnable(currentLayer(), LayerEffectType::ShadingEffect, wasShadingEnabled));
-                mDrawing->RenderAll();
+                mRenderer->Submit(*mDrawing);
             }
 
             if (activeLayer->GetShadingEffect()->mEnabled)
@@ -524,7 +526,7 @@ public:
                         }}
                     };
                     mHistory->Push(new CmdChangeEffectProperty(currentLayer(), LayerEffectType::ShadingEffect, params));
-                    mDrawing->RenderAll();
+                    mRenderer->Submit(*mDrawing);
                 }
                 if (gui.CutRight(1.0f).Spinner("fx_light_y", activeLayer->GetShadingEffect()->mLightPosition.y, -999, 999, 1, controlColor))
                 {
@@ -535,7 +537,7 @@ public:
                         }}
                     };
                     mHistory->Push(new CmdChangeEffectProperty(currentLayer(), LayerEffectType::ShadingEffect, params));
-                    mDrawing->RenderAll();
+                    mRenderer->Submit(*mDrawing);
                 }
                 gui.Spacer();
 
@@ -551,7 +553,7 @@ public:
                         {"intensity", activeLayer->GetShadingEffect()->mIntensity}
                     };
                     mHistory->Push(new CmdChangeEffectProperty(currentLayer(), LayerEffectType::ShadingEffect, params));
-                    mDrawing->RenderAll();
+                    mRenderer->Submit(*mDrawing);
                 }
 
                 gui.CutTop(3).Spacer();
@@ -560,7 +562,8 @@ public:
                 gui.CutTop(100);
                 if (gui.ColorPicker("fx_shadow_color", activeLayer->GetShadingEffect()->mColor))
                 {
-                    mDrawing->RenderAll();
+                    activeLayer->Invalidate();
+                    mRenderer->Submit(*mDrawing);
                 }
 
                 if (gui.WasClicked("fx_shadow_color"))
@@ -574,7 +577,7 @@ public:
                         }}
                     };
                     mHistory->Push(new CmdChangeEffectProperty(currentLayer(), LayerEffectType::ShadingEffect, params));
-                    mDrawing->RenderAll();
+                    mRenderer->Submit(*mDrawing);
                 }
             }
         }
@@ -627,6 +630,29 @@ public:
         gui.Spacer();
     }
 
+    // Blends the premultiplied composite over the screen scaled by zoom and clipped to area,
+    // writing the rows of the draw target directly instead of going through Draw for every pixel
+    void BlitComposite(olc::Sprite* composite, int x, int y, int scale, const Rect& area)
+    {
+        olc::Sprite* screen = GetDrawTarget();
+        const int x0 = std::max({ x, area.xMin, 0 });
+        const int y0 = std::max({ y, area.yMin, 0 });
+        const int x1 = std::min({ x + composite->width * scale, area.xMax, screen->width });
+        const int y1 = std::min({ y + composite->height * scale, area.yMax, screen->height });
+        if (x0 >= x1) return;
+
+        std::vector<olc::Pixel> scaledRow(x1 - x0);
+        for (int sy = y0; sy < y1; sy++)
+        {
+            const olc::Pixel* source = composite->GetData() + size_t((sy - y) / scale) * composite->width;
+            for (int sx = x0; sx < x1; sx++)
+            {
+                scaledRow[sx - x0] = source[(sx - x) / scale];
+            }
+            Compositor::BlendOverPremultiplied(screen->GetData() + size_t(sy) * screen->width + x0, scaledRow.data(), x1 - x0);
+        }
+    }
+
     void BuildDrawingArea()
     {
         auto& widget = gui.GetWidget("drawing_area");
@@ -647,13 +673,11 @@ public:
         int mouseY = GetMouseY() - drawingArea.yMin;
 
         SetClippingRect(drawingArea.xMin, drawingArea.yMin, drawingAreaW, drawingAreaH);
-        // Draw the mDrawing sprite at the calculated position
-        if (mDrawing)
+        // Draw the latest frame finished by the render thread at the calculated position, with
+        // all layers already flattened into one image
+        if (olc::Sprite* composite = mRenderer->GetFrame()->composite.get())
         {
-            for (const auto& layer : mDrawing->GetLayers())
-            {
-                DrawSprite(drawingX, drawingY, layer->GetSurface(), zoom);
-            }
+            BlitComposite(composite, drawingX, drawingY, zoom, drawingArea);
         }
 
         DrawRect(
@@ -662,12 +686,19 @@ public:
             gui.AdjustValue(controlColor, 0.1f)
         );
 
-        // Draw gizmos for selected elements and handle their interactions
+        // Draw gizmos for the elements in view and handle the interactions of the selected one,
+        // which is drawn last so its handles stay on top
         bool gizmoInteraction = false;
-        for (const auto& el : activeLayer->GetElements())
+        const PixelRect visibleArea{
+            (drawingArea.xMin - drawingX) / zoom - 1, (drawingArea.yMin - drawingY) / zoom - 1,
+            (drawingArea.xMax - drawingX) / zoom + 1, (drawingArea.yMax - drawingY) / zoom + 1 };
+        for (Element* el : activeLayer->GetElementsIn(visibleArea))
+        {
+            if (el != selectedElement) EditElement(el, false);
+        }
+        if (selectedElement && selectedElement->GetLayer() == activeLayer)
         {
-            bool gizmoHit = EditElement(el, el == selectedElement);
-            if (gizmoHit) gizmoInteraction = true;
+            gizmoInteraction = EditElement(selectedElement, true);
         }
 
         if (
@@ -676,7 +707,8 @@ public:
             activeLayer->GetShadingEffect()->mEnabled)
         {
             if (EditPoint(activeLayer->GetShadingEffect()->mLightPosition, gui.GetIcon(16))) {
-                mDrawing->RenderAll();
+                activeLayer->Invalidate();
+                mRenderer->Submit(*mDrawing);
                 gizmoInteraction = true;
             }
         }
@@ -706,26 +738,14 @@ public:
         // Handle element selection only if not interacting with gizmos and drawing area is active
         if (GetMouse(0).bPressed && !gizmoInteraction && widget.state != WidgetState::Normal)
         {
-            Element* clickedElement = nullptr;
-            
             // Transform mouse coordinates to drawing coordinates
             olc::vi2d mouseDrawingPos = olc::vi2d(
                 (mouseX - (drawingX - drawingArea.xMin)) / zoom,
                 (mouseY - (drawingY - drawingArea.yMin)) / zoom
             );
             
-            // Check all elements for clicks (reverse order to prioritize top elements)
-            auto elements = activeLayer->GetElements();
-            for (auto it = elements.rbegin(); it != elements.rend(); ++it)
-            {
-                Element* el = *it;
-                
-                if (el->IsPointInside(mouseDrawingPos))
-                {
-                    clickedElement = el;
-                    break; // Found the topmost element
-                }
-            }
+            // Topmost element under the mouse
+            Element* clickedElement = activeLayer->GetElementAt(mouseDrawingPos);
             
             // Update selection
             selectedElement = clickedElement;
@@ -762,7 +782,7 @@ public:
         mHistory->Reset();
         mDrawing.reset(new Shaper(drawingWidth, drawingHeight));
         activeLayer = mDrawing->AddLayer();
-        mDrawing->RenderAll();
+        mRenderer->Submit(*mDrawing);
         pan = { 0, 0 };
         zoom = 1;
     }
@@ -928,6 +948,9 @@ public:
             manipulationMode = ManipulationMode::NoneMode;
         }
 
+        // Only the area covered by the shape before and after the edit needs to be re-rendered
+        PixelRect oldBounds = activeLayer->GetElementBounds(shape);
+
         if (manipulationMode == ManipulationMode::MoveGizmo)
         {
             // Calculate new position in drawing coordinates with drag offset
@@ -936,7 +959,8 @@ public:
                 (mouseScreenPos.y - drawingY) / zoom
             );
             shape->SetPosition(mouseDrawingPos + dragOffset);
-            mDrawing->RenderAll();
+            activeLayer->Invalidate(oldBounds.Union(activeLayer->GetElementBounds(shape)));
+            mRenderer->Submit(*mDrawing);
         }
         else if (manipulationMode == ManipulationMode::Resize)
         {
@@ -968,7 +992,8 @@ public:
                 newSize.y = std::max(1, (int)(localY * 2));
             
             shape->SetSize(newSize);
-            mDrawing->RenderAll();
+            activeLayer->Invalidate(oldBounds.Union(activeLayer->GetElementBounds(shape)));
+            mRenderer->Submit(*mDrawing);
         }
         else if (manipulationMode == ManipulationMode::Rotate)
         {
@@ -983,7 +1008,8 @@ public:
             selectedElementRotation = static_cast<int>(newRotation / M_PI * 180.0f);
 
             shape->SetRotation(newRotation);
-            mDrawing->RenderAll();
+            activeLayer->Invalidate(oldBounds.Union(activeLayer->GetElementBounds(shape)));
+            mRenderer->Submit(*mDrawing);
         }
         
         return gizmoHit;
@@ -1098,7 +1124,7 @@ public:
             zoom = 1;
             activeLayer = mDrawing->GetLayers().front();
 
-            mDrawing->RenderAll();
+            mRenderer->Submit(*mDrawing);
         }
     }
 
@@ -1138,15 +1164,25 @@ public:
         NFD::Guard nfdGuard;
         NFD::UniquePath outPath;
 
-        nfdfilteritem_t filterItem[1] = {{ "Portable Network Graphics", "png" }};
+        nfdfilteritem_t filterItem[3] = {
+            { "Portable Network Graphics", "png" },
+            { "Quite OK Image", "qoi" },
+            { "Portable Arbitrary Map", "pam" }
+        };
 
-        nfdresult_t result = NFD::SaveDialog(outPath, filterItem, 1);
+        nfdresult_t result = NFD::SaveDialog(outPath, filterItem, 3);
         if (result == NFD_OKAY)
         {
             auto path = std::filesystem::path(outPath.get());
             if (!path.has_extension())
                 path.replace_extension(".png");
-            mDrawing->ExportPNG(path.string());
+
+            // The render thread owns the up to date surfaces, so the export renders the drawing itself
+            for (Layer* layer : mDrawing->GetLayers())
+            {
+                layer->Invalidate();
+            }
+            mDrawing->ExportImage(path.string(), ImageFormatFromPath(path.string()));
         }
     }
 
@@ -1182,12 +1218,91 @@ public:
     Layer* activeLayer;
 
     std::unique_ptr<History> mHistory;
+    std::unique_ptr<RenderThread> mRenderer;
 
     olc::Pixel controlColor = olc::Pixel(212, 208, 200);
 };
 
-int main()
+// Exports a drawing without opening the editor:
+//   PixelShaper export <drawing.pshape> <image> [--coverage] [--level 0-9] [--format png|qoi|pam|raw]
+// The format follows the image extension unless given. An image of "-" writes to the standard
+// output, as raw RGBA unless another format is given.
+static bool IsCommandLineExport(int argc, char* argv[])
+{
+    // Anything else on the command line, such as what launchers add, still opens the editor
+    if (argc > 1 && std::string(argv[1]) == "export") return true;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--coverage" || arg == "--level" || arg == "--format") return true;
+    }
+    return false;
+}
+
+static int ExportFromCommandLine(int argc, char* argv[])
+{
+    std::string input, output;
+    EdgeMode edges = EdgeMode::Hard;
+    int level = PngEncoder::DefaultLevel;
+    ImageFormat format = ImageFormat::PNG;
+    bool formatGiven = false, formatValid = true;
+    for (int i = (std::string(argv[1]) == "export") ? 2 : 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--coverage")
+            edges = EdgeMode::Coverage;
+        else if (arg == "--format" && i + 1 < argc)
+            formatValid = formatGiven = ImageFormatFromName(argv[++i], format);
+        else if (arg == "--level" && i + 1 < argc)
+        {
+            std::string value = argv[++i];
+            level = (value.size() == 1 && value[0] >= '0' && value[0] <= '9') ? value[0] - '0' : -1;
+        }
+        else if (input.empty())
+            input = arg;
+        else if (output.empty())
+            output = arg;
+        else
+            input.clear();
+    }
+
+    if (input.empty() || output.empty() || level < 0 || !formatValid)
+    {
+        std::cerr << "usage: " << argv[0] << " export <drawing.pshape> <image> [--coverage] [--level 0-9] [--format png|qoi|pam|raw]" << std::endl;
+        return 1;
+    }
+
+    std::ifstream file(input);
+    json in = file.is_open() ? json::parse(file, nullptr, false) : json(json::value_t::discarded);
+    if (in.is_discarded())
+    {
+        std::cerr << "could not read " << input << std::endl;
+        return 1;
+    }
+
+    // The drawing is rendered in strips, which keeps memory low however large it is
+    Shaper drawing;
+    drawing.SetLayerSurfaces(false);
+    drawing.Deserialize(in);
+    if (!formatGiven)
+    {
+        format = (output == "-") ? ImageFormat::Raw : ImageFormatFromPath(output);
+    }
+    if (!drawing.ExportImageStrips(output, format, edges, level))
+    {
+        std::cerr << "could not write " << output << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
 {
+    if (IsCommandLineExport(argc, argv))
+    {
+        return ExportFromCommandLine(argc, argv);
+    }
+
     ExampleApp demo;
     
     // Initialize the engine with screen dimensions and pixel size
@@ -0,0 +1,270 @@
+#include "png_encoder.h"
+
+#ifdef PIXELSHAPER_ZLIB
+
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+
+#include <zlib.h>
+
+namespace {
+
+// Uncompressed bytes per chunk, small chunks lose a little compression at every boundary
+constexpr size_t ChunkBytes = 256 * 1024;
+
+// Window deflate can look back in, the most of a chunk the next one can refer to
+constexpr size_t DictionaryBytes = 32 * 1024;
+
+constexpr uint8_t Signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+void PutBigEndian(uint8_t* out, uint32_t value)
+{
+    out[0] = uint8_t(value >> 24);
+    out[1] = uint8_t(value >> 16);
+    out[2] = uint8_t(value >> 8);
+    out[3] = uint8_t(value);
+}
+
+inline int Paeth(int a, int b, int c)
+{
+    const int p = a + b - c;
+    const int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    return (pb <= pc) ? b : c;
+}
+
+// Filters a row of RGBA bytes with each of the five PNG filters and keeps the one with the
+// smallest sum of absolute differences, the usual guess at what deflates best. out gets the
+// filter type followed by the filtered row, scratch holds 5 * size bytes.
+void FilterRow(const uint8_t* row, const uint8_t* previous, size_t size, uint8_t* out, uint8_t* scratch)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        const int a = (i >= 4) ? row[i - 4] : 0;
+        const int b = previous[i];
+        const int c = (i >= 4) ? previous[i - 4] : 0;
+        scratch[i] = row[i];
+        scratch[size + i] = uint8_t(row[i] - a);
+        scratch[2 * size + i] = uint8_t(row[i] - b);
+        scratch[3 * size + i] = uint8_t(row[i] - ((a + b) >> 1));
+        scratch[4 * size + i] = uint8_t(row[i] - Paeth(a, b, c));
+    }
+
+    int best = 0;
+    uint64_t bestSum = UINT64_MAX;
+    for (int filter = 0; filter < 5; filter++)
+    {
+        uint64_t sum = 0;
+        const uint8_t* filtered = scratch + filter * size;
+        for (size_t i = 0; i < size; i++)
+        {
+            sum += uint64_t(std::abs(int(int8_t(filtered[i]))));
+        }
+        if (sum < bestSum)
+        {
+            bestSum = sum;
+            best = filter;
+        }
+    }
+
+    out[0] = uint8_t(best);
+    std::copy_n(scratch + best * size, size, out + 1);
+}
+
+} // namespace
+
+PngEncoder::PngEncoder(std::ostream& out, int width, int height, int level, ThreadPool* workers)
+    : mOut(out), mWidth(width), mHeight(height), mLevel(std::clamp(level, 0, 9)), mWorkers(workers)
+{
+    const size_t rowBytes = size_t(std::max(mWidth, 0)) * 4;
+    mChunkRows = int(std::max<size_t>(1, ChunkBytes / std::max<size_t>(rowBytes, 1)));
+    mBatchChunks = workers ? int(workers->GetThreadCount()) * 2 : 1;
+    mPreviousRow.assign(rowBytes, 0);
+
+    if (mWidth <= 0 || mHeight <= 0)
+    {
+        mFailed = true;
+        return;
+    }
+
+    mOut.write(reinterpret_cast<const char*>(Signature), sizeof(Signature));
+
+    // 8 bit RGBA, no interlacing
+    uint8_t header[13] = {};
+    PutBigEndian(header, uint32_t(mWidth));
+    PutBigEndian(header + 4, uint32_t(mHeight));
+    header[8] = 8;
+    header[9] = 6;
+    WriteChunk("IHDR", header, sizeof(header));
+}
+
+bool PngEncoder::WriteRows(const olc::Pixel* rows, int count)
+{
+    const int pendingRows = mFailed ? 0 : int(mPending.size() / size_t(mWidth));
+    if (mFailed || count < 0 || count > mHeight - mRowsWritten - pendingRows)
+    {
+        mFailed = true;
+        return false;
+    }
+
+    // Whole batches are compressed straight from the caller's rows, only a partial batch is kept
+    const int batchRows = mChunkRows * mBatchChunks;
+    if (pendingRows > 0)
+    {
+        const int taken = std::min(count, batchRows - pendingRows);
+        mPending.insert(mPending.end(), rows, rows + size_t(taken) * mWidth);
+        rows += size_t(taken) * mWidth;
+        count -= taken;
+
+        if (pendingRows + taken < batchRows) return true;
+        Flush(mPending.data(), batchRows, false);
+        mPending.clear();
+    }
+
+    while (!mFailed && count >= batchRows)
+    {
+        Flush(rows, batchRows, false);
+        rows += size_t(batchRows) * mWidth;
+        count -= batchRows;
+    }
+
+    if (!mFailed) mPending.assign(rows, rows + size_t(count) * mWidth);
+    return !mFailed;
+}
+
+bool PngEncoder::Finish()
+{
+    const int pendingRows = mFailed ? 0 : int(mPending.size() / size_t(mWidth));
+    if (mFailed || mRowsWritten + pendingRows != mHeight)
+    {
+        mFailed = true;
+        return false;
+    }
+
+    Flush(mPending.data(), pendingRows, true);
+    mPending.clear();
+    WriteChunk("IEND", nullptr, 0);
+    mOut.flush();
+    return !mFailed && mOut.good();
+}
+
+void PngEncoder::Flush(const olc::Pixel* source, int rows, bool last)
+{
+    const size_t rowBytes = size_t(mWidth) * 4;
+    const size_t filteredBytes = rowBytes + 1;
+
+    // The stream still has to be ended when every row went out with earlier chunks
+    const int chunkCount = std::max((rows + mChunkRows - 1) / mChunkRows, last ? 1 : 0);
+    std::vector<std::vector<uint8_t>> filtered(chunkCount), compressed(chunkCount);
+    std::vector<uint32_t> checksums(chunkCount);
+    std::vector<char> deflated(chunkCount);
+
+    auto fnParallel = [&](const std::function<void(size_t)>& task)
+    {
+        if (mWorkers)
+        {
+            mWorkers->ParallelFor(size_t(chunkCount), task);
+            return;
+        }
+        for (size_t k = 0; k < size_t(chunkCount); k++)
+            task(k);
+    };
+
+    const uint8_t* pending = reinterpret_cast<const uint8_t*>(source);
+    fnParallel([&](size_t k)
+    {
+        const int first = int(k) * mChunkRows;
+        const int count = std::min(mChunkRows, rows - first);
+        std::vector<uint8_t> scratch(5 * rowBytes);
+        filtered[k].resize(size_t(std::max(count, 0)) * filteredBytes);
+        for (int y = first; y < first + count; y++)
+        {
+            const uint8_t* previous = (y == 0) ? mPreviousRow.data() : pending + size_t(y - 1) * rowBytes;
+            FilterRow(pending + size_t(y) * rowBytes, previous, rowBytes, filtered[k].data() + size_t(y - first) * filteredBytes, scratch.data());
+        }
+    });
+
+    // Raw deflate, every chunk but the very last ends with a sync flush so the next one can follow it
+    fnParallel([&](size_t k)
+    {
+        const std::vector<uint8_t>& input = filtered[k];
+        checksums[k] = uint32_t(adler32(adler32(0, nullptr, 0), input.data(), uInt(input.size())));
+
+        z_stream stream{};
+        if (deflateInit2(&stream, mLevel, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return;
+
+        const std::vector<uint8_t>& previous = (k > 0) ? filtered[k - 1] : mDictionary;
+        if (!previous.empty())
+        {
+            const size_t size = std::min(previous.size(), DictionaryBytes);
+            deflateSetDictionary(&stream, previous.data() + previous.size() - size, uInt(size));
+        }
+
+        const bool end = last && k + 1 == size_t(chunkCount);
+        compressed[k].resize(deflateBound(&stream, uLong(input.size())) + 16);
+        stream.next_in = const_cast<Bytef*>(input.data());
+        stream.avail_in = uInt(input.size());
+        stream.next_out = compressed[k].data();
+        stream.avail_out = uInt(compressed[k].size());
+
+        const int result = deflate(&stream, end ? Z_FINISH : Z_SYNC_FLUSH);
+        deflated[k] = (end ? result == Z_STREAM_END : result == Z_OK) && stream.avail_in == 0 && stream.avail_out > 0;
+        compressed[k].resize(stream.total_out);
+        deflateEnd(&stream);
+    });
+
+    for (int k = 0; k < chunkCount && !mFailed; k++)
+    {
+        if (!deflated[k])
+        {
+            mFailed = true;
+            break;
+        }
+
+        std::vector<uint8_t>& data = compressed[k];
+        if (mRowsWritten == 0 && k == 0)
+        {
+            // zlib header: deflate with a 32 KiB window, and the level as a hint
+            const uint8_t method = 0x78;
+            uint8_t flags = uint8_t((mLevel < 2 ? 0 : mLevel < 6 ? 1 : mLevel == 6 ? 2 : 3) << 6);
+            flags = uint8_t(flags + 31 - (method * 256 + flags) % 31);
+            data.insert(data.begin(), { method, flags });
+        }
+
+        mAdler = uint32_t(adler32_combine(mAdler, checksums[k], z_off_t(filtered[k].size())));
+        if (last && k + 1 == chunkCount)
+        {
+            uint8_t trailer[4];
+            PutBigEndian(trailer, mAdler);
+            data.insert(data.end(), trailer, trailer + 4);
+        }
+        WriteChunk("IDAT", data.data(), data.size());
+    }
+
+    if (rows > 0)
+    {
+        const std::vector<uint8_t>& tail = filtered.back();
+        mDictionary.assign(tail.end() - std::min(tail.size(), DictionaryBytes), tail.end());
+        std::copy_n(pending + size_t(rows - 1) * rowBytes, rowBytes, mPreviousRow.begin());
+    }
+    mRowsWritten += rows;
+}
+
+void PngEncoder::WriteChunk(const char* type, const uint8_t* data, size_t size)
+{
+    uint8_t length[4], crc[4];
+    PutBigEndian(length, uint32_t(size));
+
+    uLong checksum = crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+    if (size > 0) checksum = crc32(checksum, data, uInt(size));
+    PutBigEndian(crc, uint32_t(checksum));
+
+    mOut.write(reinterpret_cast<const char*>(length), 4);
+    mOut.write(type, 4);
+    if (size > 0) mOut.write(reinterpret_cast<const char*>(data), std::streamsize(size));
+    mOut.write(reinterpret_cast<const char*>(crc), 4);
+    if (!mOut) mFailed = true;
+}
+
+#endif // PIXELSHAPER_ZLIB
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "image_writer.h"
+
+#include <vector>
+
+// Writes RGBA images as PNG, row by row. Rows are gathered into chunks that are filtered and
+// deflated on worker threads, pigz style: every chunk takes the last 32 KiB of the one before as
+// its dictionary and ends on a byte boundary, so the chunks join into a single zlib stream.
+// Needs zlib, which builds define PIXELSHAPER_ZLIB for.
+class PngEncoder : public ImageWriter {
+public:
+    // zlib compression levels: 0 stores, 1 is the fastest and 9 the smallest
+    static constexpr int DefaultLevel = 6;
+
+    // Writes the header of a width x height image, the chunks are compressed across workers when given
+    PngEncoder(std::ostream& out, int width, int height, int level = DefaultLevel, ThreadPool* workers = nullptr);
+
+    // Adds count rows of straight alpha pixels. Returns false once anything failed to be written.
+    bool WriteRows(const olc::Pixel* rows, int count) override;
+
+    // Compresses the rows still waiting and ends the image, once every row was written
+    bool Finish() override;
+
+private:
+    // Compresses rows from source, last ends the zlib stream
+    void Flush(const olc::Pixel* source, int rows, bool last);
+    void WriteChunk(const char* type, const uint8_t* data, size_t size);
+
+    std::ostream& mOut;
+    int mWidth, mHeight, mLevel;
+    ThreadPool* mWorkers;
+
+    // Rows of a chunk and chunks compressed together, enough to keep every worker busy
+    int mChunkRows, mBatchChunks;
+
+    // Rows of a batch not complete yet, the last row compressed which the next one is filtered against,
+    // and the end of the last chunk which primes the next one
+    std::vector<olc::Pixel> mPending;
+    std::vector<uint8_t> mPreviousRow;
+    std::vector<uint8_t> mDictionary;
+    int mRowsWritten{ 0 };
+    uint32_t mAdler{ 1 };
+    bool mFailed{ false };
+};
@@ -0,0 +1,235 @@
+#include "render_thread.h"
+
+#include "compositor.h"
+
+#include <algorithm>
+
+RenderThread::RenderThread()
+{
+    mThread = std::thread(&RenderThread::Run, this);
+}
+
+RenderThread::~RenderThread()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+        mCancel = true;
+    }
+    mWake.notify_all();
+    mThread.join();
+}
+
+void RenderThread::Submit(Shaper& drawing)
+{
+    auto snapshot = std::make_unique<Snapshot>();
+    snapshot->workers = drawing.GetWorkers();
+    for (Layer* layer : drawing.GetLayers())
+    {
+        if (!layer || !layer->GetSurface()) continue;
+
+        LayerSnapshot entry{ layer->GetID(), layer->GetSurface()->width, layer->GetSurface()->height, layer->TakeDirtyRegion(), nullptr };
+        if (!entry.dirty.IsEmpty())
+        {
+            entry.scene = layer->CloneScene();
+        }
+        snapshot->layers.push_back(std::move(entry));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        snapshot->serial = ++mSubmitted;
+        if (mPending)
+        {
+            Merge(*mPending, *snapshot);
+        }
+        mPending = std::move(snapshot);
+
+        // Whatever is rendering now is already out of date
+        if (mBusy) mCancel = true;
+    }
+    mWake.notify_one();
+}
+
+const RenderFrame* RenderThread::GetFrame()
+{
+    if (mReady.load(std::memory_order_acquire) & FreshFrame)
+    {
+        mFront = mReady.exchange(mFront, std::memory_order_acq_rel) & ~FreshFrame;
+    }
+    return &mFrames[mFront];
+}
+
+void RenderThread::Run()
+{
+    while (true)
+    {
+        std::unique_ptr<Snapshot> snapshot;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mWake.wait(lock, [this] { return mStop || mPending; });
+            if (mStop) return;
+
+            snapshot = std::move(mPending);
+            mCancel = false;
+            mBusy = true;
+        }
+
+        bool finished = Render(*snapshot);
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (!finished)
+            {
+                // Superseded, the newer snapshot also has to redo what this one did not get to
+                if (mPending)
+                {
+                    Merge(*snapshot, *mPending);
+                }
+                else
+                {
+                    mPending = std::move(snapshot);
+                }
+            }
+            mBusy = false;
+        }
+    }
+}
+
+bool RenderThread::Render(Snapshot& snapshot)
+{
+    for (auto& entry : snapshot.layers)
+    {
+        if (!entry.scene) continue;
+        if (mCancel) return false;
+
+        // The new scene takes over the surfaces of the previous one, so only the dirty part is redrawn
+        auto& target = mTargets[entry.id];
+        if (target)
+        {
+            entry.scene->TakeSurfaces(*target);
+        }
+
+        olc::Sprite* surface = entry.scene->GetSurface();
+        if (!surface || surface->width != entry.width || surface->height != entry.height)
+        {
+            entry.scene->Resize(entry.width, entry.height);
+            entry.dirty = PixelRect::Unbounded();
+        }
+
+        target = std::move(entry.scene);
+        target->Render(entry.dirty, snapshot.workers.get());
+
+        // Kept even when cancelled after this, the layer will not render these pixels again
+        mCompositeDirty = mCompositeDirty.Union(target->GetRenderRegion(entry.dirty));
+    }
+
+    // Drop layers that are no longer part of the drawing
+    for (auto it = mTargets.begin(); it != mTargets.end();)
+    {
+        bool used = std::any_of(snapshot.layers.begin(), snapshot.layers.end(),
+            [&](const LayerSnapshot& entry) { return entry.id == it->first; });
+        it = used ? std::next(it) : mTargets.erase(it);
+    }
+
+    UpdateComposite(snapshot);
+    Publish(snapshot);
+    return true;
+}
+
+void RenderThread::UpdateComposite(const Snapshot& snapshot)
+{
+    std::vector<Layer*> layers;
+    std::vector<size_t> order;
+    for (const auto& entry : snapshot.layers)
+    {
+        auto it = mTargets.find(entry.id);
+        if (it == mTargets.end() || !it->second->GetSurface()) continue;
+        layers.push_back(it->second.get());
+        order.push_back(entry.id);
+    }
+
+    if (layers.empty())
+    {
+        mComposite.reset();
+        mCompositeOrder.clear();
+        mCompositeDirty = {};
+        return;
+    }
+
+    const int width = layers.front()->GetSurface()->width;
+    const int height = layers.front()->GetSurface()->height;
+    if (!mComposite || mComposite->width != width || mComposite->height != height || order != mCompositeOrder)
+    {
+        if (!mComposite || mComposite->width != width || mComposite->height != height)
+        {
+            mComposite = std::make_unique<olc::Sprite>(width, height);
+        }
+        mCompositeOrder = std::move(order);
+        mCompositeDirty = PixelRect::Unbounded();
+    }
+
+    const PixelRect region = mCompositeDirty.Intersect({ 0, 0, width, height });
+    mCompositeDirty = {};
+    if (region.IsEmpty()) return;
+
+    SpriteView(mComposite.get()).Fill(region, olc::Pixel(0, 0, 0, 0));
+    for (Layer* layer : layers)
+    {
+        Compositor::BlendOver(mComposite.get(), layer->GetSurface(), region);
+    }
+
+    for (PixelRect& stale : mFrameDirty)
+    {
+        stale = stale.Union(region);
+    }
+}
+
+void RenderThread::Publish(const Snapshot& snapshot)
+{
+    RenderFrame& frame = mFrames[mBack];
+    frame.serial = snapshot.serial;
+
+    if (!mComposite)
+    {
+        frame.composite.reset();
+    }
+    else
+    {
+        const int width = mComposite->width, height = mComposite->height;
+        auto& copy = frame.composite;
+        if (!copy || copy->width != width || copy->height != height)
+        {
+            copy = std::make_unique<olc::Sprite>(width, height);
+            mFrameDirty[mBack] = PixelRect::Unbounded();
+        }
+
+        // Only what changed since this buffer was last published is copied
+        SpriteView(copy.get()).Copy(SpriteView(mComposite.get()), mFrameDirty[mBack].Intersect({ 0, 0, width, height }));
+    }
+    mFrameDirty[mBack] = {};
+
+    mBack = mReady.exchange(mBack | FreshFrame, std::memory_order_acq_rel) & ~FreshFrame;
+}
+
+void RenderThread::Merge(Snapshot& older, Snapshot& newer)
+{
+    for (auto& entry : older.layers)
+    {
+        if (!entry.scene) continue;
+
+        auto it = std::find_if(newer.layers.begin(), newer.layers.end(),
+            [&](const LayerSnapshot& other) { return other.id == entry.id; });
+        if (it == newer.layers.end()) continue;
+
+        if (it->scene)
+        {
+            it->dirty = it->dirty.Union(entry.dirty);
+        }
+        else
+        {
+            it->scene = std::move(entry.scene);
+            it->dirty = entry.dirty;
+        }
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "shaper.h"
+
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <unordered_map>
+
+// Every layer of a finished render flattened into one image with premultiplied alpha
+struct RenderFrame {
+    std::unique_ptr<olc::Sprite> composite;
+    uint64_t serial{ 0 };
+};
+
+// Renders a drawing on a background thread so editing never waits for the renderer.
+// Each submit snapshots the layers that changed; the render thread keeps its own copy of
+// every layer surface and publishes finished frames through a lock-free triple buffer.
+class RenderThread {
+public:
+    RenderThread();
+    ~RenderThread();
+
+    RenderThread(const RenderThread&) = delete;
+    RenderThread& operator=(const RenderThread&) = delete;
+
+    // Snapshots the dirty layers of the drawing and queues them for rendering, taking over
+    // their dirty regions. A render still in flight is cancelled and its work folded into
+    // the new one. Call from the thread that edits the drawing.
+    void Submit(Shaper& drawing);
+
+    // Latest completed frame, never blocks. The frame stays valid until the next call.
+    const RenderFrame* GetFrame();
+
+private:
+    struct LayerSnapshot {
+        size_t id;
+        int width, height;
+        PixelRect dirty;
+
+        // Copy of the layer without surfaces, only for layers that changed
+        std::unique_ptr<Layer> scene;
+    };
+
+    struct Snapshot {
+        std::vector<LayerSnapshot> layers;
+
+        // Workers of the drawing, kept alive while the snapshot renders
+        std::shared_ptr<ThreadPool> workers;
+        uint64_t serial{ 0 };
+    };
+
+    void Run();
+    bool Render(Snapshot& snapshot);
+    void Publish(const Snapshot& snapshot);
+    void UpdateComposite(const Snapshot& snapshot);
+
+    // Carries the layers that older still has to render over to newer
+    static void Merge(Snapshot& older, Snapshot& newer);
+
+    std::thread mThread;
+    std::mutex mMutex;
+    std::condition_variable mWake;
+    std::unique_ptr<Snapshot> mPending;
+    std::atomic<bool> mCancel{ false };
+    bool mBusy{ false };
+    bool mStop{ false };
+    uint64_t mSubmitted{ 0 };
+
+    // Owned by the render thread
+    std::unordered_map<size_t, std::unique_ptr<Layer>> mTargets;
+
+    // Flattened layers, only recomposed where layers were rendered since the last publish,
+    // or entirely when the layer order changes
+    std::unique_ptr<olc::Sprite> mComposite;
+    std::vector<size_t> mCompositeOrder;
+    PixelRect mCompositeDirty;
+
+    // The render thread fills mFrames[mBack] and the UI reads mFrames[mFront]. mReady holds
+    // the index of the newest finished frame, with FreshFrame set until the UI picks it up.
+    static constexpr uint32_t FreshFrame = 4;
+    RenderFrame mFrames[3];
+
+    // Part of the composite each frame is missing since it was last published
+    PixelRect mFrameDirty[3];
+    std::atomic<uint32_t> mReady{ 1 };
+    uint32_t mFront{ 0 }, mBack{ 2 };
+};
@@ -0,0 +1,340 @@
+#include "sdf_batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SDF_BATCH_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only allow wide intrinsics inside functions compiled for that instruction set,
+// MSVC always allows them
+#define SDF_BATCH_PRAGMA(x) _Pragma(#x)
+#if defined(__clang__)
+#define SDF_BATCH_TARGET_BEGIN(isa) SDF_BATCH_PRAGMA(clang attribute push(__attribute__((target(isa))), apply_to = function))
+#define SDF_BATCH_TARGET_END SDF_BATCH_PRAGMA(clang attribute pop)
+#elif defined(__GNUC__)
+#define SDF_BATCH_TARGET_BEGIN(isa) SDF_BATCH_PRAGMA(GCC push_options) SDF_BATCH_PRAGMA(GCC target(isa))
+#define SDF_BATCH_TARGET_END SDF_BATCH_PRAGMA(GCC pop_options)
+#else
+#define SDF_BATCH_TARGET_BEGIN(isa)
+#define SDF_BATCH_TARGET_END
+#endif
+
+namespace {
+
+struct KernelTable {
+    void (*evaluate)(PrimitiveType, const float*, const float*, float*, int);
+    void (*selectClosest)(float*, uint32_t*, const float*, uint32_t, int);
+    void (*unite)(float*, const float*, float, int);
+    void (*intersect)(float*, const float*, int);
+    void (*subtract)(float*, const float*, int);
+    void (*evaluateGradient)(PrimitiveType, const float*, const float*, const float*, float*, float*, float*, int);
+    void (*uniteGradient)(float*, float*, float*, const float*, const float*, const float*, float, int);
+    void (*intersectGradient)(float*, float*, float*, const float*, const float*, const float*, int);
+    void (*subtractGradient)(float*, float*, float*, const float*, const float*, const float*, int);
+    void (*lighting)(const float*, const float*, const float*, const float*, float, float, float*, int);
+};
+
+template <class K>
+constexpr KernelTable MakeKernelTable()
+{
+    return {
+        K::Evaluate, K::SelectClosest, K::Union, K::Intersect, K::Subtract,
+        K::EvaluateGradient, K::Union, K::Intersect, K::Subtract,
+        K::Lighting
+    };
+}
+
+namespace scalar {
+
+struct Ops {
+    using F = float;
+    using M = bool;
+    using I = uint32_t;
+    static constexpr int Width = 1;
+
+    static F Load(const float* p) { return *p; }
+    static void Store(float* p, F a) { *p = a; }
+    static F Set(float a) { return a; }
+    static F Add(F a, F b) { return a + b; }
+    static F Sub(F a, F b) { return a - b; }
+    static F Mul(F a, F b) { return a * b; }
+    static F Div(F a, F b) { return a / b; }
+    static F Neg(F a) { return -a; }
+    static F Sqrt(F a) { return std::sqrt(a); }
+    static F Abs(F a) { return std::abs(a); }
+    static F Min(F a, F b) { return (b < a) ? b : a; }
+    static F Max(F a, F b) { return (a < b) ? b : a; }
+    static M Less(F a, F b) { return a < b; }
+    static M Greater(F a, F b) { return a > b; }
+    static F Select(M m, F a, F b) { return m ? a : b; }
+
+    static I LoadI(const uint32_t* p) { return *p; }
+    static void StoreI(uint32_t* p, I a) { *p = a; }
+    static I SetI(uint32_t a) { return a; }
+    static I SelectI(M m, I a, I b) { return m ? a : b; }
+};
+
+#include "sdf_batch_kernels.h"
+
+} // namespace scalar
+
+#ifdef SDF_BATCH_X86
+
+// Min and Max take their operands swapped so they return the same operand as std::min and std::max
+
+namespace sse2 {
+
+SDF_BATCH_TARGET_BEGIN("sse2")
+
+struct Ops {
+    using F = __m128;
+    using M = __m128;
+    using I = __m128i;
+    static constexpr int Width = 4;
+
+    static F Load(const float* p) { return _mm_loadu_ps(p); }
+    static void Store(float* p, F a) { _mm_storeu_ps(p, a); }
+    static F Set(float a) { return _mm_set1_ps(a); }
+    static F Add(F a, F b) { return _mm_add_ps(a, b); }
+    static F Sub(F a, F b) { return _mm_sub_ps(a, b); }
+    static F Mul(F a, F b) { return _mm_mul_ps(a, b); }
+    static F Div(F a, F b) { return _mm_div_ps(a, b); }
+    static F Neg(F a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+    static F Sqrt(F a) { return _mm_sqrt_ps(a); }
+    static F Abs(F a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+    static F Min(F a, F b) { return _mm_min_ps(b, a); }
+    static F Max(F a, F b) { return _mm_max_ps(b, a); }
+    static M Less(F a, F b) { return _mm_cmplt_ps(a, b); }
+    static M Greater(F a, F b) { return _mm_cmpgt_ps(a, b); }
+    static F Select(M m, F a, F b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+
+    static I LoadI(const uint32_t* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+    static void StoreI(uint32_t* p, I a) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), a); }
+    static I SetI(uint32_t a) { return _mm_set1_epi32(int(a)); }
+    static I SelectI(M m, I a, I b) { return _mm_castps_si128(Select(m, _mm_castsi128_ps(a), _mm_castsi128_ps(b))); }
+};
+
+#include "sdf_batch_kernels.h"
+
+SDF_BATCH_TARGET_END
+
+} // namespace sse2
+
+namespace avx2 {
+
+SDF_BATCH_TARGET_BEGIN("avx2")
+
+struct Ops {
+    using F = __m256;
+    using M = __m256;
+    using I = __m256i;
+    static constexpr int Width = 8;
+
+    static F Load(const float* p) { return _mm256_loadu_ps(p); }
+    static void Store(float* p, F a) { _mm256_storeu_ps(p, a); }
+    static F Set(float a) { return _mm256_set1_ps(a); }
+    static F Add(F a, F b) { return _mm256_add_ps(a, b); }
+    static F Sub(F a, F b) { return _mm256_sub_ps(a, b); }
+    static F Mul(F a, F b) { return _mm256_mul_ps(a, b); }
+    static F Div(F a, F b) { return _mm256_div_ps(a, b); }
+    static F Neg(F a) { return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f)); }
+    static F Sqrt(F a) { return _mm256_sqrt_ps(a); }
+    static F Abs(F a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+    static F Min(F a, F b) { return _mm256_min_ps(b, a); }
+    static F Max(F a, F b) { return _mm256_max_ps(b, a); }
+    static M Less(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static M Greater(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static F Select(M m, F a, F b) { return _mm256_blendv_ps(b, a, m); }
+
+    static I LoadI(const uint32_t* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+    static void StoreI(uint32_t* p, I a) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), a); }
+    static I SetI(uint32_t a) { return _mm256_set1_epi32(int(a)); }
+    static I SelectI(M m, I a, I b) { return _mm256_castps_si256(Select(m, _mm256_castsi256_ps(a), _mm256_castsi256_ps(b))); }
+};
+
+#include "sdf_batch_kernels.h"
+
+SDF_BATCH_TARGET_END
+
+} // namespace avx2
+
+namespace avx512 {
+
+SDF_BATCH_TARGET_BEGIN("avx512f")
+
+struct Ops {
+    using F = __m512;
+    using M = __mmask16;
+    using I = __m512i;
+    static constexpr int Width = 16;
+
+    static F Load(const float* p) { return _mm512_loadu_ps(p); }
+    static void Store(float* p, F a) { _mm512_storeu_ps(p, a); }
+    static F Set(float a) { return _mm512_set1_ps(a); }
+    static F Add(F a, F b) { return _mm512_add_ps(a, b); }
+    static F Sub(F a, F b) { return _mm512_sub_ps(a, b); }
+    static F Mul(F a, F b) { return _mm512_mul_ps(a, b); }
+    static F Div(F a, F b) { return _mm512_div_ps(a, b); }
+    static F Neg(F a) { return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_set1_epi32(int(0x80000000u)))); }
+    // The zero-masked forms with a full mask avoid GCC 12 warning about the undefined source in the plain ones
+    static F Sqrt(F a) { return _mm512_maskz_sqrt_ps(0xffff, a); }
+    static F Abs(F a) { return _mm512_abs_ps(a); }
+    static F Min(F a, F b) { return _mm512_maskz_min_ps(0xffff, b, a); }
+    static F Max(F a, F b) { return _mm512_maskz_max_ps(0xffff, b, a); }
+    static M Less(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+    static M Greater(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+    static F Select(M m, F a, F b) { return _mm512_mask_blend_ps(m, b, a); }
+
+    static I LoadI(const uint32_t* p) { return _mm512_loadu_si512(p); }
+    static void StoreI(uint32_t* p, I a) { _mm512_storeu_si512(p, a); }
+    static I SetI(uint32_t a) { return _mm512_set1_epi32(int(a)); }
+    static I SelectI(M m, I a, I b) { return _mm512_mask_blend_epi32(m, b, a); }
+};
+
+#include "sdf_batch_kernels.h"
+
+SDF_BATCH_TARGET_END
+
+} // namespace avx512
+
+#endif // SDF_BATCH_X86
+
+const KernelTable& GetKernelTable(SimdLevel level)
+{
+    static const KernelTable tables[] = {
+        MakeKernelTable<scalar::Kernels<scalar::Ops>>(),
+#ifdef SDF_BATCH_X86
+        MakeKernelTable<sse2::Kernels<sse2::Ops>>(),
+        MakeKernelTable<avx2::Kernels<avx2::Ops>>(),
+        MakeKernelTable<avx512::Kernels<avx512::Ops>>(),
+#endif
+    };
+    return tables[static_cast<int>(level)];
+}
+
+SimdLevel DetectSimdLevel()
+{
+#if !defined(SDF_BATCH_X86)
+    return SimdLevel::Scalar;
+#elif defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    bool sse2 = (info[3] & (1 << 26)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave || maxLeaf < 7) return sse2 ? SimdLevel::SSE2 : SimdLevel::Scalar;
+
+    // The OS has to save the wide registers on context switches
+    unsigned long long xcr0 = _xgetbv(0);
+    bool ymmState = (xcr0 & 0x06) == 0x06;
+    bool zmmState = (xcr0 & 0xe6) == 0xe6;
+
+    __cpuidex(info, 7, 0);
+    bool avx2 = (info[1] & (1 << 5)) != 0;
+    bool avx512f = (info[1] & (1 << 16)) != 0;
+
+    if (avx512f && zmmState) return SimdLevel::AVX512;
+    if (avx2 && ymmState) return SimdLevel::AVX2;
+    return sse2 ? SimdLevel::SSE2 : SimdLevel::Scalar;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse2")) return SimdLevel::SSE2;
+    return SimdLevel::Scalar;
+#endif
+}
+
+const SimdLevel supportedLevel = DetectSimdLevel();
+std::atomic<const KernelTable*> activeKernels{ &GetKernelTable(supportedLevel) };
+std::atomic<SimdLevel> activeLevel{ supportedLevel };
+
+} // namespace
+
+void SdfBatch::Evaluate(PrimitiveType type, const float* u, const float* v, float* out, int count)
+{
+    activeKernels.load(std::memory_order_relaxed)->evaluate(type, u, v, out, count);
+}
+
+void SdfBatch::SelectClosest(float* closest, uint32_t* color, const float* sdf, uint32_t elementColor, int count)
+{
+    activeKernels.load(std::memory_order_relaxed)->selectClosest(closest, color, sdf, elementColor, count);
+}
+
+void SdfBatch::Union(float* accum, const float* sdf, float smoothness, int count)
+{
+    activeKernels.load(std::memory_order_relaxed)->unite(accum, sdf, smoothness, count);
+}
+
+void SdfBatch::Intersect(float* accum, const float* sdf, int count)
+{
+    activeKernels.load(std::memory_order_relaxed)->intersect(accum, sdf, count);
+}
+
+void SdfBatch::Subtract(float* accum, const float* sdf, int count)
+{
+    activeKernels.load(std::memory_order_relaxed)->subtract(accum, sdf, count);
+}
+
+void SdfBatch::EvaluateGradient(PrimitiveType type, const float* u, const float* v, const float* jacobian, float* out, float* gx, float* gy, int count)
+{
+    activeKernels.load(std::memory_order_relaxed)->evaluateGradient(type, u, v, jacobian, out, gx, gy, count);
+}
+
+void SdfBatch::Union(float* accum, float* accumX, float* accumY, const float* sdf, const float* gx, const float* gy, float smoothness, int count)
+{
+    activeKernels.load(std::memory_order_relaxed)->uniteGradient(accum, accumX, accumY, sdf, gx, gy, smoothness, count);
+}
+
+void SdfBatch::Intersect(float* accum, float* accumX, float* accumY, const float* sdf, const float* gx, const float* gy, int count)
+{
+    activeKernels.load(std::memory_order_relaxed)->intersectGradient(accum, accumX, accumY, sdf, gx, gy, count);
+}
+
+void SdfBatch::Subtract(float* accum, float* accumX, float* accumY, const float* sdf, const float* gx, const float* gy, int count)
+{
+    activeKernels.load(std::memory_order_relaxed)->subtractGradient(accum, accumX, accumY, sdf, gx, gy, count);
+}
+
+void SdfBatch::Lighting(const float* nx, const float* ny, const float* nz, const float* lx, float ly, float lz, float* out, int count)
+{
+    activeKernels.load(std::memory_order_relaxed)->lighting(nx, ny, nz, lx, ly, lz, out, count);
+}
+
+SimdLevel SdfBatch::GetLevel()
+{
+    return activeLevel.load(std::memory_order_relaxed);
+}
+
+SimdLevel SdfBatch::GetSupportedLevel()
+{
+    return supportedLevel;
+}
+
+void SdfBatch::SetLevel(SimdLevel level)
+{
+    level = std::min(level, supportedLevel);
+    activeKernels.store(&GetKernelTable(level), std::memory_order_relaxed);
+    activeLevel.store(level, std::memory_order_relaxed);
+}
+
+const char* SdfBatch::GetLevelName(SimdLevel level)
+{
+    switch (level)
+    {
+        case SimdLevel::Scalar: return "scalar";
+        case SimdLevel::SSE2: return "SSE2";
+        case SimdLevel::AVX2: return "AVX2";
+        case SimdLevel::AVX512: return "AVX-512";
+    }
+    return "unknown";
+}
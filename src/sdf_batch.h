@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+
+#include "shaper.h"
+
+// Instruction sets the batch kernels can run on, from narrowest to widest
+enum class SimdLevel {
+    Scalar = 0,
+    SSE2,
+    AVX2,
+    AVX512
+};
+
+// Evaluates primitive SDFs and join operations, and lights the result, over a run of pixels at once.
+// The widest instruction set the CPU supports is picked on first use, and every
+// level produces the same results as the scalar fallback.
+class SdfBatch {
+public:
+    // Buffers passed in must hold count rounded up to a multiple of Padding values,
+    // the lanes past count are computed but their results are meaningless
+    static constexpr int Padding = 16;
+
+    static int PaddedCount(int count) { return (count + Padding - 1) / Padding * Padding; }
+
+    // out[i] = SDF of the primitive at the normalized point (u[i], v[i])
+    static void Evaluate(PrimitiveType type, const float* u, const float* v, float* out, int count);
+
+    // Keeps the color of the closest element seen so far for every pixel
+    static void SelectClosest(float* closest, uint32_t* color, const float* sdf, uint32_t elementColor, int count);
+
+    // accum[i] = accum[i] joined with sdf[i]
+    static void Union(float* accum, const float* sdf, float smoothness, int count);
+    static void Intersect(float* accum, const float* sdf, int count);
+    static void Subtract(float* accum, const float* sdf, int count);
+
+    // Same as Evaluate, also writing the gradient of the SDF in pixels. jacobian holds the
+    // derivatives of the normalized point: du/dx, dv/dx, du/dy, dv/dy.
+    static void EvaluateGradient(PrimitiveType type, const float* u, const float* v, const float* jacobian,
+        float* out, float* gx, float* gy, int count);
+
+    // Joins that carry the gradient (accumX, accumY) of accum along, the values match the ones above
+    static void Union(float* accum, float* accumX, float* accumY, const float* sdf, const float* gx, const float* gy, float smoothness, int count);
+    static void Intersect(float* accum, float* accumX, float* accumY, const float* sdf, const float* gx, const float* gy, int count);
+    static void Subtract(float* accum, float* accumX, float* accumY, const float* sdf, const float* gx, const float* gy, int count);
+
+    // out[i] = max(0, n . normalized light vector), with the normal (nx[i], ny[i], nz[i]) and the
+    // vector from the pixel to the light (lx[i], ly, lz)
+    static void Lighting(const float* nx, const float* ny, const float* nz, const float* lx, float ly, float lz, float* out, int count);
+
+    static SimdLevel GetLevel();
+    static SimdLevel GetSupportedLevel();
+
+    // Forces an instruction set, capped to what the CPU supports
+    static void SetLevel(SimdLevel level);
+
+    static const char* GetLevelName(SimdLevel level);
+};
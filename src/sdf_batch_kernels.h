@@ -0,0 +1,279 @@
+// Batch kernels shared by every instruction set, written against an Ops type that
+// wraps the vector registers. sdf_batch.cpp includes this file once per instruction
+// set, inside its own namespace and target region, so there is no include guard.
+//
+// The arithmetic mirrors the scalar SDFs in shaper.cpp operation for operation,
+// which keeps all instruction sets bit-identical to each other.
+
+template <class Ops>
+struct Kernels {
+    using F = typename Ops::F;
+    using M = typename Ops::M;
+    using I = typename Ops::I;
+
+    static F Clamp01(F x)
+    {
+        F zero = Ops::Set(0.0f), one = Ops::Set(1.0f);
+        return Ops::Select(Ops::Less(x, zero), zero, Ops::Select(Ops::Greater(x, one), one, x));
+    }
+
+    static F Sign(F x)
+    {
+        F zero = Ops::Set(0.0f);
+        return Ops::Select(Ops::Greater(x, zero), Ops::Set(1.0f),
+            Ops::Select(Ops::Less(x, zero), Ops::Set(-1.0f), zero));
+    }
+
+    static F Ellipse(F x, F y)
+    {
+        return Ops::Sub(Ops::Sqrt(Ops::Add(Ops::Mul(x, x), Ops::Mul(y, y))), Ops::Set(1.0f));
+    }
+
+    static F Rectangle(F x, F y)
+    {
+        F zero = Ops::Set(0.0f), one = Ops::Set(1.0f);
+        F dx = Ops::Sub(Ops::Abs(x), one);
+        F dy = Ops::Sub(Ops::Abs(y), one);
+        F mx = Ops::Max(dx, zero);
+        F my = Ops::Max(dy, zero);
+        F outside = Ops::Sqrt(Ops::Add(Ops::Mul(mx, mx), Ops::Mul(my, my)));
+        return Ops::Add(outside, Ops::Min(Ops::Max(dx, dy), zero));
+    }
+
+    static F Triangle(F x, F y)
+    {
+        // Same as TriangleElement::SDF with the unit extents q = (1, 1) folded in
+        F half = Ops::Set(0.5f), one = Ops::Set(1.0f);
+        F px = Ops::Abs(x);
+        F py = Ops::Add(Ops::Mul(y, half), half);
+
+        F t = Clamp01(Ops::Div(Ops::Add(px, py), Ops::Set(2.0f)));
+        F ax = Ops::Sub(px, t);
+        F ay = Ops::Sub(py, t);
+        F bx = Ops::Sub(px, Clamp01(px));
+        F by = Ops::Sub(py, one);
+
+        F d = Ops::Min(Ops::Add(Ops::Mul(ax, ax), Ops::Mul(ay, ay)), Ops::Add(Ops::Mul(bx, bx), Ops::Mul(by, by)));
+        F s = Ops::Max(Ops::Sub(px, py), Ops::Sub(py, one));
+        return Ops::Mul(Ops::Sqrt(d), Sign(s));
+    }
+
+    // Gradients with respect to (x, y) of the primitives above, the values match them exactly.
+    // Where the gradient is undefined, at the center or on a corner, it is zero.
+
+    static F SafeDiv(F a, F length)
+    {
+        F zero = Ops::Set(0.0f);
+        return Ops::Select(Ops::Greater(length, zero), Ops::Div(a, length), zero);
+    }
+
+    static F Ellipse(F x, F y, F& gx, F& gy)
+    {
+        F length = Ops::Sqrt(Ops::Add(Ops::Mul(x, x), Ops::Mul(y, y)));
+        gx = SafeDiv(x, length);
+        gy = SafeDiv(y, length);
+        return Ops::Sub(length, Ops::Set(1.0f));
+    }
+
+    static F Rectangle(F x, F y, F& gx, F& gy)
+    {
+        F zero = Ops::Set(0.0f), one = Ops::Set(1.0f);
+        F dx = Ops::Sub(Ops::Abs(x), one);
+        F dy = Ops::Sub(Ops::Abs(y), one);
+        F mx = Ops::Max(dx, zero);
+        F my = Ops::Max(dy, zero);
+        F outside = Ops::Sqrt(Ops::Add(Ops::Mul(mx, mx), Ops::Mul(my, my)));
+
+        // Outside the gradient points away from the closest point of the box, inside away from the closest side
+        M outer = Ops::Greater(outside, zero);
+        M sideY = Ops::Less(dx, dy);
+        gx = Ops::Mul(Sign(x), Ops::Select(outer, SafeDiv(mx, outside), Ops::Select(sideY, zero, one)));
+        gy = Ops::Mul(Sign(y), Ops::Select(outer, SafeDiv(my, outside), Ops::Select(sideY, one, zero)));
+        return Ops::Add(outside, Ops::Min(Ops::Max(dx, dy), zero));
+    }
+
+    static F Triangle(F x, F y, F& gx, F& gy)
+    {
+        F half = Ops::Set(0.5f), one = Ops::Set(1.0f);
+        F px = Ops::Abs(x);
+        F py = Ops::Add(Ops::Mul(y, half), half);
+
+        F t = Clamp01(Ops::Div(Ops::Add(px, py), Ops::Set(2.0f)));
+        F ax = Ops::Sub(px, t);
+        F ay = Ops::Sub(py, t);
+        F bx = Ops::Sub(px, Clamp01(px));
+        F by = Ops::Sub(py, one);
+
+        F da = Ops::Add(Ops::Mul(ax, ax), Ops::Mul(ay, ay));
+        F db = Ops::Add(Ops::Mul(bx, bx), Ops::Mul(by, by));
+        F d = Ops::Min(da, db);
+        F s = Sign(Ops::Max(Ops::Sub(px, py), Ops::Sub(py, one)));
+        F length = Ops::Sqrt(d);
+
+        // Away from the closest point of the closer edge, then back through the fold and the y scale
+        M edgeB = Ops::Less(db, da);
+        gx = Ops::Mul(Ops::Mul(SafeDiv(Ops::Select(edgeB, bx, ax), length), s), Sign(x));
+        gy = Ops::Mul(Ops::Mul(SafeDiv(Ops::Select(edgeB, by, ay), length), s), half);
+        return Ops::Mul(length, s);
+    }
+
+    template <F (*Primitive)(F, F)>
+    static void EvaluateRow(const float* u, const float* v, float* out, int count)
+    {
+        for (int i = 0; i < count; i += Ops::Width)
+        {
+            Ops::Store(out + i, Primitive(Ops::Load(u + i), Ops::Load(v + i)));
+        }
+    }
+
+    static void Evaluate(PrimitiveType type, const float* u, const float* v, float* out, int count)
+    {
+        switch (type)
+        {
+            case PrimitiveType::Ellipse: EvaluateRow<Ellipse>(u, v, out, count); break;
+            case PrimitiveType::Rectangle: EvaluateRow<Rectangle>(u, v, out, count); break;
+            case PrimitiveType::Triangle: EvaluateRow<Triangle>(u, v, out, count); break;
+        }
+    }
+
+    // The gradient in element coordinates is turned into one in pixels with the transform derivatives
+    template <F (*Primitive)(F, F, F&, F&)>
+    static void EvaluateGradientRow(const float* u, const float* v, const float* jacobian, float* out, float* gx, float* gy, int count)
+    {
+        F ux = Ops::Set(jacobian[0]), vx = Ops::Set(jacobian[1]);
+        F uy = Ops::Set(jacobian[2]), vy = Ops::Set(jacobian[3]);
+        for (int i = 0; i < count; i += Ops::Width)
+        {
+            F gu, gv;
+            Ops::Store(out + i, Primitive(Ops::Load(u + i), Ops::Load(v + i), gu, gv));
+            Ops::Store(gx + i, Ops::Add(Ops::Mul(gu, ux), Ops::Mul(gv, vx)));
+            Ops::Store(gy + i, Ops::Add(Ops::Mul(gu, uy), Ops::Mul(gv, vy)));
+        }
+    }
+
+    static void EvaluateGradient(PrimitiveType type, const float* u, const float* v, const float* jacobian, float* out, float* gx, float* gy, int count)
+    {
+        switch (type)
+        {
+            case PrimitiveType::Ellipse: EvaluateGradientRow<Ellipse>(u, v, jacobian, out, gx, gy, count); break;
+            case PrimitiveType::Rectangle: EvaluateGradientRow<Rectangle>(u, v, jacobian, out, gx, gy, count); break;
+            case PrimitiveType::Triangle: EvaluateGradientRow<Triangle>(u, v, jacobian, out, gx, gy, count); break;
+        }
+    }
+
+    static void SelectClosest(float* closest, uint32_t* color, const float* sdf, uint32_t elementColor, int count)
+    {
+        I c = Ops::SetI(elementColor);
+        for (int i = 0; i < count; i += Ops::Width)
+        {
+            F d = Ops::Load(sdf + i);
+            F best = Ops::Load(closest + i);
+            M nearer = Ops::Less(d, best);
+            Ops::Store(closest + i, Ops::Select(nearer, d, best));
+            Ops::StoreI(color + i, Ops::SelectI(nearer, c, Ops::LoadI(color + i)));
+        }
+    }
+
+    static void Union(float* accum, const float* sdf, float smoothness, int count)
+    {
+        // Circular smooth union
+        float k = smoothness * (1.0f / (1.0f - std::sqrt(0.5f)));
+        F kv = Ops::Set(k), halfK = Ops::Set(k * 0.5f);
+        F zero = Ops::Set(0.0f), one = Ops::Set(1.0f), two = Ops::Set(2.0f);
+
+        for (int i = 0; i < count; i += Ops::Width)
+        {
+            F a = Ops::Load(accum + i);
+            F b = Ops::Load(sdf + i);
+            F h = Ops::Div(Ops::Max(Ops::Sub(kv, Ops::Abs(Ops::Sub(a, b))), zero), kv);
+            F arc = Ops::Sub(Ops::Add(one, h), Ops::Sqrt(Ops::Sub(one, Ops::Mul(h, Ops::Sub(h, two)))));
+            Ops::Store(accum + i, Ops::Sub(Ops::Min(a, b), Ops::Mul(halfK, arc)));
+        }
+    }
+
+    static void Union(float* accum, float* accumX, float* accumY, const float* sdf, const float* gx, const float* gy, float smoothness, int count)
+    {
+        float k = smoothness * (1.0f / (1.0f - std::sqrt(0.5f)));
+        F kv = Ops::Set(k), halfK = Ops::Set(k * 0.5f);
+        F zero = Ops::Set(0.0f), half = Ops::Set(0.5f), one = Ops::Set(1.0f), two = Ops::Set(2.0f);
+
+        for (int i = 0; i < count; i += Ops::Width)
+        {
+            F a = Ops::Load(accum + i);
+            F b = Ops::Load(sdf + i);
+            F h = Ops::Div(Ops::Max(Ops::Sub(kv, Ops::Abs(Ops::Sub(a, b))), zero), kv);
+            F root = Ops::Sqrt(Ops::Sub(one, Ops::Mul(h, Ops::Sub(h, two))));
+            F arc = Ops::Sub(Ops::Add(one, h), root);
+            Ops::Store(accum + i, Ops::Sub(Ops::Min(a, b), Ops::Mul(halfK, arc)));
+
+            // The blend moves weight from the smaller operand to the other one, by nothing where
+            // they are further than k apart and by half where they are equal
+            M pickB = Ops::Less(b, a);
+            F blend = Ops::Mul(half, Ops::Sub(one, Ops::Div(Ops::Sub(one, h), root)));
+            F weightA = Ops::Select(pickB, blend, Ops::Sub(one, blend));
+            F weightB = Ops::Sub(one, weightA);
+            Ops::Store(accumX + i, Ops::Add(Ops::Mul(weightA, Ops::Load(accumX + i)), Ops::Mul(weightB, Ops::Load(gx + i))));
+            Ops::Store(accumY + i, Ops::Add(Ops::Mul(weightA, Ops::Load(accumY + i)), Ops::Mul(weightB, Ops::Load(gy + i))));
+        }
+    }
+
+    static void Intersect(float* accum, float* accumX, float* accumY, const float* sdf, const float* gx, const float* gy, int count)
+    {
+        for (int i = 0; i < count; i += Ops::Width)
+        {
+            F a = Ops::Load(accum + i);
+            F b = Ops::Load(sdf + i);
+            M pickB = Ops::Less(a, b);
+            Ops::Store(accum + i, Ops::Max(a, b));
+            Ops::Store(accumX + i, Ops::Select(pickB, Ops::Load(gx + i), Ops::Load(accumX + i)));
+            Ops::Store(accumY + i, Ops::Select(pickB, Ops::Load(gy + i), Ops::Load(accumY + i)));
+        }
+    }
+
+    static void Subtract(float* accum, float* accumX, float* accumY, const float* sdf, const float* gx, const float* gy, int count)
+    {
+        for (int i = 0; i < count; i += Ops::Width)
+        {
+            F a = Ops::Load(accum + i);
+            F b = Ops::Neg(Ops::Load(sdf + i));
+            M pickB = Ops::Less(a, b);
+            Ops::Store(accum + i, Ops::Max(a, b));
+            Ops::Store(accumX + i, Ops::Select(pickB, Ops::Neg(Ops::Load(gx + i)), Ops::Load(accumX + i)));
+            Ops::Store(accumY + i, Ops::Select(pickB, Ops::Neg(Ops::Load(gy + i)), Ops::Load(accumY + i)));
+        }
+    }
+
+    static void Lighting(const float* nx, const float* ny, const float* nz, const float* lx, float ly, float lz, float* out, int count)
+    {
+        // Same as the light vector normalized with vec3::norm and dotted with the normal
+        F zero = Ops::Set(0.0f), one = Ops::Set(1.0f);
+        F dy = Ops::Set(ly), dz = Ops::Set(lz);
+        for (int i = 0; i < count; i += Ops::Width)
+        {
+            F dx = Ops::Load(lx + i);
+            F scale = Ops::Div(one, Ops::Sqrt(Ops::Add(Ops::Add(Ops::Mul(dx, dx), Ops::Mul(dy, dy)), Ops::Mul(dz, dz))));
+            F d = Ops::Add(Ops::Add(
+                Ops::Mul(Ops::Load(nx + i), Ops::Mul(dx, scale)),
+                Ops::Mul(Ops::Load(ny + i), Ops::Mul(dy, scale))),
+                Ops::Mul(Ops::Load(nz + i), Ops::Mul(dz, scale)));
+            Ops::Store(out + i, Ops::Max(zero, d));
+        }
+    }
+
+    static void Intersect(float* accum, const float* sdf, int count)
+    {
+        for (int i = 0; i < count; i += Ops::Width)
+        {
+            Ops::Store(accum + i, Ops::Max(Ops::Load(accum + i), Ops::Load(sdf + i)));
+        }
+    }
+
+    static void Subtract(float* accum, const float* sdf, int count)
+    {
+        // Subtraction is intersection with negated second operand
+        for (int i = 0; i < count; i += Ops::Width)
+        {
+            Ops::Store(accum + i, Ops::Max(Ops::Load(accum + i), Ops::Neg(Ops::Load(sdf + i))));
+        }
+    }
+};
@@ -1,14 +1,28 @@
 #include "shaper.h"
 
 #include <algorithm>
+#include <bit>
+#include <cfloat>
 #include <cmath>
-
+#include <fstream>
+#include <future>
+#include <iostream>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "compositor.h"
+#include "image_writer.h"
+#include "png_encoder.h"
+#include "sdf_batch.h"
 #include "stb_image_write.h"
 
 size_t Layer::mNextID = 1;
 size_t Element::mNextID = 1;
 
-float EllipseElement::GetSDF(olc::vf2d p) const
+float EllipseElement::SDF(olc::vf2d p)
 {
     // p is in normalized coordinates where the ellipse should be a unit circle
     // Simple circle SDF - distance from origin minus radius of 1
@@ -38,14 +52,9 @@ bool EllipseElement::IsPointInside(const olc::vi2d &point) const
     return (normX + normY) <= 1.0f;
 }
 
-void EllipseElement::Serialize(json &out) const
-{
-    out["type"] = "ellipse";
-    Element::Serialize(out);
-}
-
 void Element::Serialize(json &out) const
 {
+    out["type"] = Primitives::GetName(GetType());
     out["id"] = mID;
     out["position"] = { mPosition.x, mPosition.y };
     out["size"] = { mSize.x, mSize.y };
@@ -82,7 +91,7 @@ void Element::Deserialize(const json &in)
     }
 }
 
-float RectangleElement::GetSDF(olc::vf2d p) const
+float RectangleElement::SDF(olc::vf2d p)
 {
     // p is in normalized coordinates where the rectangle should be a unit square
     // Simple box SDF - unit square centered at origin with extents [-1, 1]
@@ -112,20 +121,232 @@ bool RectangleElement::IsPointInside(const olc::vi2d &point) const
             rotatedY >= -size.y / 2 && rotatedY <= size.y / 2);
 }
 
-void RectangleElement::Serialize(json &out) const
+PixelRect Element::GetBounds(float reach) const
+{
+    // Without a size the SDF is evaluated in pixels and can reach anywhere
+    if (mSize.x <= 0 || mSize.y <= 0)
+    {
+        return PixelRect::Unbounded();
+    }
+
+    // All primitives fit in the [-1, 1] square, and the triangle SDF is squashed
+    // vertically by 2, so SDF < reach stays inside a square of half size 1 + 2 * reach
+    float extent = 1.0f + 2.0f * std::max(reach, 0.0f);
+    float hx = mSize.x / 2.0f * extent;
+    float hy = mSize.y / 2.0f * extent;
+
+    float c = std::abs(std::cos(mRotation));
+    float s = std::abs(std::sin(mRotation));
+    float ex = c * hx + s * hy;
+    float ey = s * hx + c * hy;
+
+    // One extra pixel on each side absorbs rounding in the pixel to local transform
+    return {
+        int(std::floor(mPosition.x - ex)) - 1,
+        int(std::floor(mPosition.y - ey)) - 1,
+        int(std::ceil(mPosition.x + ex)) + 2,
+        int(std::ceil(mPosition.y + ey)) + 2
+    };
+}
+
+void Element::Moved()
+{
+    if (mLayer) mLayer->mIndex.Update(this);
+}
+
+bool ElementIndex::GetCells(const PixelRect& bounds, PixelRect& cells)
+{
+    if (bounds.xMin <= PixelRect::Unbounded().xMin || bounds.yMin <= PixelRect::Unbounded().yMin) return false;
+
+    auto fnCell = [](int v) { return (v >= 0) ? v / CellSize : -((CellSize - 1 - v) / CellSize); };
+    cells = { fnCell(bounds.xMin), fnCell(bounds.yMin), fnCell(bounds.xMax - 1) + 1, fnCell(bounds.yMax - 1) + 1 };
+    return true;
+}
+
+uint64_t ElementIndex::CellKey(int cx, int cy)
+{
+    return (uint64_t(uint32_t(cx)) << 32) | uint32_t(cy);
+}
+
+void ElementIndex::Link(const Entry& entry)
+{
+    PixelRect cells;
+    if (!GetCells(entry.bounds, cells))
+    {
+        mUnbounded.push_back(entry);
+        return;
+    }
+
+    for (int cy = cells.yMin; cy < cells.yMax; cy++)
+    {
+        for (int cx = cells.xMin; cx < cells.xMax; cx++)
+        {
+            mCells[CellKey(cx, cy)].push_back(entry);
+        }
+    }
+}
+
+void ElementIndex::Unlink(const Entry& entry)
+{
+    auto fnErase = [&](std::vector<Entry>& entries)
+    {
+        auto it = std::find_if(entries.begin(), entries.end(),
+            [&](const Entry& other) { return other.element == entry.element; });
+        if (it == entries.end()) return;
+        *it = entries.back();
+        entries.pop_back();
+    };
+
+    PixelRect cells;
+    if (!GetCells(entry.bounds, cells))
+    {
+        fnErase(mUnbounded);
+        return;
+    }
+
+    for (int cy = cells.yMin; cy < cells.yMax; cy++)
+    {
+        for (int cx = cells.xMin; cx < cells.xMax; cx++)
+        {
+            auto it = mCells.find(CellKey(cx, cy));
+            if (it == mCells.end()) continue;
+            fnErase(it->second);
+            if (it->second.empty()) mCells.erase(it);
+        }
+    }
+}
+
+void ElementIndex::Insert(Element* element)
+{
+    Entry entry{ element, element->GetBounds(), mNextOrder++ };
+    mEntries[element] = entry;
+    Link(entry);
+}
+
+void ElementIndex::Update(Element* element)
+{
+    auto it = mEntries.find(element);
+    if (it == mEntries.end()) return;
+
+    PixelRect bounds = element->GetBounds();
+    if (bounds.xMin == it->second.bounds.xMin && bounds.yMin == it->second.bounds.yMin &&
+        bounds.xMax == it->second.bounds.xMax && bounds.yMax == it->second.bounds.yMax) return;
+
+    // Keeps its place in the layer order
+    Unlink(it->second);
+    it->second.bounds = bounds;
+    Link(it->second);
+}
+
+void ElementIndex::Remove(const Element* element)
+{
+    auto it = mEntries.find(element);
+    if (it == mEntries.end()) return;
+
+    Unlink(it->second);
+    mEntries.erase(it);
+}
+
+void ElementIndex::Clear()
+{
+    mCells.clear();
+    mEntries.clear();
+    mUnbounded.clear();
+}
+
+Element* ElementIndex::FindAt(const olc::vi2d& point) const
 {
-    out["type"] = "rectangle";
-    Element::Serialize(out);
+    const Entry* topmost = nullptr;
+    auto fnVisit = [&](const std::vector<Entry>& entries)
+    {
+        for (const Entry& entry : entries)
+        {
+            if (topmost && entry.order < topmost->order) continue;
+            if (!entry.bounds.Contains(PixelRect{ point.x, point.y, point.x + 1, point.y + 1 })) continue;
+            if (entry.element->IsPointInside(point)) topmost = &entry;
+        }
+    };
+
+    PixelRect cells;
+    GetCells({ point.x, point.y, point.x + 1, point.y + 1 }, cells);
+    auto it = mCells.find(CellKey(cells.xMin, cells.yMin));
+    if (it != mCells.end()) fnVisit(it->second);
+    fnVisit(mUnbounded);
+
+    return topmost ? topmost->element : nullptr;
+}
+
+std::vector<Element*> ElementIndex::FindIn(const PixelRect& area) const
+{
+    std::vector<const Entry*> found;
+    for (const Entry& entry : mUnbounded)
+    {
+        found.push_back(&entry);
+    }
+
+    // Elements spanning several cells are reported by the cell where their overlap with area starts
+    auto fnVisit = [&](int cx, int cy, const std::vector<Entry>& entries)
+    {
+        for (const Entry& entry : entries)
+        {
+            PixelRect overlap = entry.bounds.Intersect(area);
+            if (overlap.IsEmpty()) continue;
+
+            PixelRect first;
+            GetCells({ overlap.xMin, overlap.yMin, overlap.xMin + 1, overlap.yMin + 1 }, first);
+            if (first.xMin == cx && first.yMin == cy) found.push_back(&entry);
+        }
+    };
+
+    PixelRect cells;
+    if (area.IsEmpty())
+    {
+        found.clear();
+    }
+    else if (!GetCells(area, cells) || int64_t(cells.xMax - cells.xMin) * (cells.yMax - cells.yMin) > int64_t(mCells.size()))
+    {
+        // Areas larger than the occupied part of the grid walk the occupied cells instead
+        for (const auto& [key, entries] : mCells)
+        {
+            fnVisit(int32_t(key >> 32), int32_t(uint32_t(key)), entries);
+        }
+    }
+    else
+    {
+        for (int cy = cells.yMin; cy < cells.yMax; cy++)
+        {
+            for (int cx = cells.xMin; cx < cells.xMax; cx++)
+            {
+                auto it = mCells.find(CellKey(cx, cy));
+                if (it != mCells.end()) fnVisit(cx, cy, it->second);
+            }
+        }
+    }
+
+    std::sort(found.begin(), found.end(), [](const Entry* a, const Entry* b) { return a->order < b->order; });
+
+    std::vector<Element*> elements;
+    elements.reserve(found.size());
+    for (const Entry* entry : found)
+    {
+        elements.push_back(entry->element);
+    }
+    return elements;
 }
 
 Element* Layer::AddElement(Element *element)
 {
     mElements.push_back(std::unique_ptr<Element>(element));
+    element->mLayer = this;
+    mIndex.Insert(element);
+    Invalidate(GetElementBounds(element));
     return mElements.back().get();
 }
 
 void Layer::RemoveElement(Element *element)
 {
+    Invalidate(GetElementBounds(element));
+    mIndex.Remove(element);
     auto it = std::remove_if(mElements.begin(), mElements.end(),
         [element](const std::unique_ptr<Element>& e) { return e.get() == element; });
     mElements.erase(it, mElements.end());
@@ -144,7 +365,9 @@ Element *Layer::GetElement(size_t id) const
 void Layer::Resize(int width, int height)
 {
     mSurface.reset(new olc::Sprite(width, height));
-    mNormals.reset(new olc::Sprite(width, height));
+    mNormals.reset();
+    mDistanceField.resize(size_t(width) * size_t(height));
+    mEffectBuffers.Resize(width, height);
     Clear();
 }
 
@@ -152,14 +375,21 @@ void Layer::Clear()
 {
     if (!mSurface) return;
 
-    for (int y = 0; y < mSurface->height; y++)
-    {
-        for (int x = 0; x < mSurface->width; x++)
-        {
-            mSurface->SetPixel(x, y, olc::Pixel(0, 0, 0, 0));
-            mNormals->SetPixel(x, y, olc::Pixel(128, 128, 255, 255));
-        }
-    }
+    SpriteView(mSurface.get()).Fill(olc::Pixel(0, 0, 0, 0));
+    std::fill(mDistanceField.begin(), mDistanceField.end(), UnresolvedDistance);
+    Invalidate();
+}
+
+void Layer::Invalidate()
+{
+    mDirtyRegion = PixelRect::Unbounded();
+    mGeneration++;
+}
+
+void Layer::Invalidate(const PixelRect& region)
+{
+    mDirtyRegion = mDirtyRegion.Union(region);
+    mGeneration++;
 }
 
 template <typename T>
@@ -175,13 +405,237 @@ T mod(T x, T m)
     return (r < 0) ? r + m : r;
 }
 
-void Layer::Render()
+// Side length, in pixels, of the square tiles a layer is rendered in
+constexpr int RenderTileSize = 32;
+
+static int TileCount(int pixels)
+{
+    return (pixels + RenderTileSize - 1) / RenderTileSize;
+}
+
+// Calls fn(tile, x0, y0, x1, y1) for every tile of a width pixels wide surface that overlaps area,
+// clipped to area, on the workers if given. Tiles are numbered row by row over the whole surface.
+static void ForEachTile(
+    ThreadPool* workers,
+    int width, const PixelRect& area,
+    const std::function<void(size_t, int, int, int, int)>& fn
+)
+{
+    if (area.IsEmpty()) return;
+
+    const int tilesX = TileCount(width);
+    const int firstX = area.xMin / RenderTileSize, firstY = area.yMin / RenderTileSize;
+    const int countX = TileCount(area.xMax) - firstX;
+    const int countY = TileCount(area.yMax) - firstY;
+
+    auto fnTile = [&](size_t index)
+    {
+        int tx = firstX + int(index % countX);
+        int ty = firstY + int(index / countX);
+        int x0 = tx * RenderTileSize, y0 = ty * RenderTileSize;
+        fn(
+            size_t(ty) * tilesX + tx,
+            std::max(x0, area.xMin), std::max(y0, area.yMin),
+            std::min(x0 + RenderTileSize, area.xMax), std::min(y0 + RenderTileSize, area.yMax)
+        );
+    };
+
+    const size_t tileCount = size_t(countX) * size_t(countY);
+    if (workers)
+    {
+        workers->ParallelFor(tileCount, fnTile);
+    }
+    else
+    {
+        for (size_t i = 0; i < tileCount; i++)
+            fnTile(i);
+    }
+}
+
+// Range of x, [lo, hi], over which a primitive's SDF drops below offset along the row
+// (ax + dx * x, ay + dy * x) of its normalized coordinates. For a negative offset every x in it is
+// that far inside, for a positive one it covers every x that close to the shape.
+static void PrimitiveSpan(PrimitiveType type, double ax, double ay, double dx, double dy, double offset, double& lo, double& hi)
+{
+    lo = -HUGE_VAL;
+    hi = HUGE_VAL;
+
+    // Keeps the part of the row where a + b * x < 0
+    auto fnHalfPlane = [&](double a, double b)
+    {
+        if (b > 0.0) hi = std::min(hi, -a / b);
+        else if (b < 0.0) lo = std::max(lo, -a / b);
+        else if (a >= 0.0) hi = lo - 1.0;
+    };
+
+    switch (type)
+    {
+        case PrimitiveType::Ellipse:
+        {
+            // |p| < 1 + offset is a quadratic in x
+            const double radius = 1.0 + offset;
+            const double a = dx * dx + dy * dy;
+            const double b = ax * dx + ay * dy;
+            const double c = ax * ax + ay * ay - radius * radius;
+            if (radius <= 0.0) { hi = lo - 1.0; break; }
+            if (a <= 0.0) { fnHalfPlane(c, 0.0); break; }
+
+            const double discriminant = b * b - a * c;
+            if (discriminant <= 0.0) { hi = lo - 1.0; break; }
+            const double root = std::sqrt(discriminant);
+            lo = (-b - root) / a;
+            hi = (-b + root) / a;
+            break;
+        }
+        case PrimitiveType::Rectangle:
+        {
+            // Both coordinates within the square grown by offset, which rounds off no corners
+            const double extent = 1.0 + offset;
+            fnHalfPlane(ax - extent, dx);
+            fnHalfPlane(-ax - extent, -dx);
+            fnHalfPlane(ay - extent, dy);
+            fnHalfPlane(-ay - extent, -dy);
+            break;
+        }
+        case PrimitiveType::Triangle:
+        {
+            // Squashed the way the SDF does it, the triangle is |x| < y < 1 and both edges move by offset
+            const double ey = 0.5 * ay + 0.5, edy = 0.5 * dy;
+            const double slant = offset * std::sqrt(2.0);
+            fnHalfPlane(ey - 1.0 - offset, edy);
+            fnHalfPlane(ax - ey - slant, dx - edy);
+            fnHalfPlane(-ax - ey - slant, -dx - edy);
+            break;
+        }
+    }
+}
+
+float Layer::GetElementReach() const
+{
+    // Outside of its bounds a union element is at least this far away, far enough for the
+    // smooth union to leave the accumulated distance untouched wherever it matters
+    const float blend = (mMergeSmoothness + 1e-3f) / (1.0f - std::sqrt(0.5f));
+    return 0.5f + 3.0f * (mMergeSmoothness + 1e-3f + blend);
+}
+
+PixelRect Layer::GetElementBounds(const Element* element) const
+{
+    if (!mSurface) return {};
+
+    const PixelRect surfaceRect{ 0, 0, mSurface->width, mSurface->height };
+    auto fnOnSurface = [&](const PixelRect& bounds)
+    {
+        return PixelRect{ bounds.xMin, bounds.yMin - mFirstRow, bounds.xMax, bounds.yMax - mFirstRow }.Intersect(surfaceRect);
+    };
+
+    switch (element->GetJoinOperation())
+    {
+        case JoinOperation::Union:
+            return fnOnSurface(element->GetBounds(GetElementReach()));
+        case JoinOperation::Subtraction:
+            // Subtraction also carves the inside of other shapes down to -distance,
+            // which needs up to one extra unit
+            return fnOnSurface(element->GetBounds(GetElementReach() + 1.0f));
+        case JoinOperation::Intersection:
+        default:
+            // An intersection clips everything outside of it
+            return surfaceRect;
+    }
+}
+
+void Layer::Render(ThreadPool* workers)
 {
     if (!mSurface) return;
+    Render({ 0, 0, mSurface->width, mSurface->height }, workers);
+}
+
+PixelRect Layer::GetRenderRegion(const PixelRect& dirty) const
+{
+    if (!mSurface) return {};
+
+    return dirty.Expand(GetRenderMargin()).Intersect({ 0, 0, mSurface->width, mSurface->height });
+}
+
+int Layer::GetRenderMargin() const
+{
+    // Coverage looks one pixel around, and the contour reaches its thickness further
+    return (mEdgeMode == EdgeMode::Coverage ? 1 : 0) + (mContourEffect->mEnabled ? mContourEffect->mThickness : 0);
+}
+
+void Layer::Render(const PixelRect& dirty, ThreadPool* workers)
+{
+    if (!mSurface) return;
+
+    const PixelRect surfaceRect{ 0, 0, mSurface->width, mSurface->height };
+    const PixelRect region = GetRenderRegion(dirty);
+    if (region.IsEmpty()) return;
+
+    const SpriteView surface(mSurface.get());
+
+    RenderProgram program;
+    Compile(program);
+
+    // Bin elements into the tiles their bounds reach, keeping the layer order in every bin
+    const int tilesX = TileCount(mSurface->width);
+    const int tilesY = TileCount(mSurface->height);
+    std::vector<std::vector<uint32_t>> tileBins(size_t(tilesX) * size_t(tilesY));
 
-    auto fnStep = [](float a, float b)
+    for (uint32_t i = 0; i < mElements.size(); i++)
     {
-        return (a < b) ? 1.0f : 0.0f;
+        PixelRect bounds = GetElementBounds(mElements[i].get()).Intersect(region);
+        if (bounds.IsEmpty()) continue;
+
+        int tx1 = TileCount(bounds.xMax), ty1 = TileCount(bounds.yMax);
+        for (int ty = bounds.yMin / RenderTileSize; ty < ty1; ty++)
+        {
+            for (int tx = bounds.xMin / RenderTileSize; tx < tx1; tx++)
+            {
+                tileBins[ty * tilesX + tx].push_back(i);
+            }
+        }
+    }
+
+    // The first element that is not subtracted starts the shape. A tile that drops it starts out
+    // outside instead, so a later intersection clips the empty shape rather than taking its place.
+    uint32_t leadingElement = 0;
+    while (leadingElement < program.joins.size() && program.joins[leadingElement] == JoinOperation::Subtraction) leadingElement++;
+
+    const float smoothness = mMergeSmoothness + 1e-3f;
+
+    // Shading needs the normal of every covered pixel, so the inside of the shape is evaluated too
+    // and the gradient is carried along. Everything else only needs the sign of the field.
+    const bool withNormals = mShadingEffect->mEnabled;
+
+    // Normals are only kept for shading, which reads them just inside the region it shades
+    if (!withNormals)
+    {
+        mNormals.reset();
+    }
+    else if (!mNormals)
+    {
+        mNormals.reset(new olc::Sprite(mSurface->width, mSurface->height));
+    }
+    const float normalHeight = 2.0f / mSurface->width;
+
+    // With the normals at hand, shading runs on every row right after it is rendered instead of as a separate pass
+    const ShadingEffect::Palette shadingPalette = withNormals ? mShadingEffect->MakePalette() : ShadingEffect::Palette{};
+
+    // Without merge smoothness the shape is a plain boolean of the primitives, so rows are
+    // rasterized as spans and only pixels near an edge are evaluated
+    const bool hardEdges = !withNormals && mMergeSmoothness == 0.0f;
+
+    // Coverage keeps the color of pixels just outside the shape, their alpha comes later
+    const bool coverage = mEdgeMode == EdgeMode::Coverage;
+
+    auto fnSDF = [](PrimitiveType type, olc::vf2d p)
+    {
+        switch (type)
+        {
+            case PrimitiveType::Ellipse: return EllipseElement::SDF(p);
+            case PrimitiveType::Rectangle: return RectangleElement::SDF(p);
+            case PrimitiveType::Triangle: return TriangleElement::SDF(p);
+        }
+        return 1e30f;
     };
 
     auto fnUnion = [](float a, float b, float k)
@@ -192,143 +646,546 @@ void Layer::Render()
         return std::min(a, b) - k * 0.5f * (1.0f + h - std::sqrt(1.0f - h * (h - 2.0f)));
     };
 
-    auto fnIntersection = [](float d1, float d2)
+    // Every pixel is independent, so tiles can be rendered in any order
+    ForEachTile(workers, mSurface->width, region, [&](size_t tile, int x0, int y0, int x1, int y1)
     {
-        return std::max(d1, d2);
-    };
+        const auto& bin = tileBins[tile];
+        const bool leadingCulled = !std::binary_search(bin.begin(), bin.end(), leadingElement);
+
+        // Row buffers for the batch kernels, padded to the widest vector. Coordinates start at the
+        // tile edge, so a block starting further in needs room for its offset too.
+        constexpr int RowCapacity = (RenderTileSize + SdfBatch::Padding - 1) / SdfBatch::Padding * SdfBatch::Padding;
+        alignas(64) float localU[RowCapacity + SdfBatch::Padding], localV[RowCapacity + SdfBatch::Padding];
+        alignas(64) float sdf[RowCapacity], closestDistance[RowCapacity], sdfAccum[RowCapacity];
+        alignas(64) float gradientX[RowCapacity], gradientY[RowCapacity], accumX[RowCapacity], accumY[RowCapacity];
+        alignas(64) uint32_t pixelColor[RowCapacity];
+
+        // Edge of the whole tile, x0 is only where the region starts within it
+        const int tileX = x0 - x0 % RenderTileSize;
+
+        // Coordinates are stepped in scalar from the tile edge, so every instruction set sees the
+        // same inputs and a pixel gets the same coordinates whichever block or region renders it.
+        // Rows are taken in drawing coordinates, which keeps them the same in a strip of the drawing.
+        auto fnRowCoordinates = [&](uint32_t i, int y, int length)
+        {
+            float u = program.ux[i] * tileX + program.uy[i] * (y + mFirstRow) + program.u0[i];
+            float v = program.vx[i] * tileX + program.vy[i] * (y + mFirstRow) + program.v0[i];
+            for (int j = 0; j < length; j++)
+            {
+                localU[j] = u;
+                localV[j] = v;
+                u += program.ux[i];
+                v += program.vx[i];
+            }
+        };
 
-    auto fnSubtract = [=](float d1, float d2)
-    {
-        // Subtraction is intersection with negated second operand
-        return fnIntersection(d1, -d2);
-    };
+        // Evaluates every pixel of the block
+        auto fnRenderBlock = [&](const PixelRect& block)
+        {
+            const int offset = block.xMin - tileX;
+            const int count = block.xMax - block.xMin;
+            const int padded = SdfBatch::PaddedCount(count);
+
+            for (int y = block.yMin; y < block.yMax; y++)
+            {
+                std::fill_n(closestDistance, padded, 1e30f);
+                std::fill_n(sdfAccum, padded, 1e30f);
+                std::fill_n(pixelColor, padded, olc::Pixel(0, 0, 0, 0).n);
+                if (withNormals)
+                {
+                    std::fill_n(accumX, padded, 0.0f);
+                    std::fill_n(accumY, padded, 0.0f);
+                }
+                bool firstElement = !leadingCulled;
+
+                // Each element is swept over the whole row, its SDF feeds both the color selection and the merged shape.
+                // For shading the gradient is carried along through the joins.
+                for (uint32_t i : bin)
+                {
+                    fnRowCoordinates(i, y, offset + padded);
+                    if (withNormals)
+                    {
+                        const float jacobian[4] = { program.ux[i], program.vx[i], program.uy[i], program.vy[i] };
+                        SdfBatch::EvaluateGradient(program.types[i], localU + offset, localV + offset, jacobian, sdf, gradientX, gradientY, count);
+                    }
+                    else
+                    {
+                        SdfBatch::Evaluate(program.types[i], localU + offset, localV + offset, sdf, count);
+                    }
+
+                    // Closest non-subtractive element gives the color
+                    if (program.joins[i] != JoinOperation::Subtraction)
+                    {
+                        SdfBatch::SelectClosest(closestDistance, pixelColor, sdf, program.colors[i].n, count);
+                    }
+
+                    if (withNormals && firstElement && program.joins[i] != JoinOperation::Subtraction)
+                    {
+                        std::copy_n(gradientX, padded, accumX);
+                        std::copy_n(gradientY, padded, accumY);
+                    }
 
-    std::vector<float> sdfMap;
-    sdfMap.resize(mSurface->width * mSurface->height);
+                    switch (program.joins[i])
+                    {
+                        case JoinOperation::Union:
+                            if (firstElement) {
+                                std::copy_n(sdf, padded, sdfAccum);
+                                firstElement = false;
+                            } else if (withNormals) {
+                                SdfBatch::Union(sdfAccum, accumX, accumY, sdf, gradientX, gradientY, smoothness, count);
+                            } else {
+                                SdfBatch::Union(sdfAccum, sdf, smoothness, count);
+                            }
+                            break;
+                        case JoinOperation::Intersection:
+                            if (firstElement) {
+                                std::copy_n(sdf, padded, sdfAccum);
+                                firstElement = false;
+                            } else if (withNormals) {
+                                SdfBatch::Intersect(sdfAccum, accumX, accumY, sdf, gradientX, gradientY, count);
+                            } else {
+                                SdfBatch::Intersect(sdfAccum, sdf, count);
+                            }
+                            break;
+                        case JoinOperation::Subtraction:
+                            if (withNormals) {
+                                SdfBatch::Subtract(sdfAccum, accumX, accumY, sdf, gradientX, gradientY, count);
+                            } else {
+                                SdfBatch::Subtract(sdfAccum, sdf, count);
+                            }
+                            break;
+                    }
+                }
 
-    auto fnPixelsToNormalized = [&](int x, int y, Element* el) {
-        olc::vf2d worldPos{ float(x), float(y) };
-        olc::vf2d localPos = worldPos - el->GetPosition();
+                // Tiles cover the whole region, so pixels outside of the shape are cleared here
+                olc::Pixel* surfaceRow = surface.Row(y) + block.xMin;
+                float* fieldRow = mDistanceField.data() + size_t(y) * mSurface->width + block.xMin;
+                for (int j = 0; j < count; j++)
+                {
+                    surfaceRow[j] = (sdfAccum[j] < 0.0f || coverage) ? olc::Pixel(pixelColor[j]) : olc::Pixel(0, 0, 0, 0);
+                    fieldRow[j] = sdfAccum[j];
+                }
 
-        // Rotation
-        float cosAngle = ::cos(-el->GetRotation());
-        float sinAngle = ::sin(-el->GetRotation());
-        olc::vf2d rotatedPos{
-            localPos.x * cosAngle - localPos.y * sinAngle,
-            localPos.x * sinAngle + localPos.y * cosAngle
+                if (!withNormals) continue;
+
+                // The field seen as a height map, with the surface tilted by its gradient. Shading
+                // leaves transparent pixels alone, so only covered ones need a normal.
+                olc::Pixel* normalRow = mNormals->GetData() + size_t(y) * mSurface->width + block.xMin;
+                for (int j = 0; j < count; j++)
+                {
+                    if (surfaceRow[j].a == 0) continue;
+
+                    vec3 n = vec3{ -accumX[j], -accumY[j], normalHeight }.norm();
+                    normalRow[j] = olc::PixelF(
+                        n.x * 0.5f + 0.5f,
+                        n.y * 0.5f + 0.5f,
+                        n.z * 0.5f + 0.5f
+                    );
+                }
+
+                olc::Pixel* shadedRow = surface.Row(y);
+                mShadingEffect->ShadeRow(shadingPalette, shadedRow, normalRow - block.xMin, shadedRow,
+                    y + mFirstRow, block.xMin, block.xMax, mSurface->width);
+            }
         };
 
-        // Scaling
-        olc::vf2d scale{ el->GetSize().x / 2.0f, el->GetSize().y / 2.0f };
-        if (scale.x > 0.0f && scale.y > 0.0f) {
-            rotatedPos.x /= scale.x;
-            rotatedPos.y /= scale.y;
+        // Fills a block the shape fully covers, only the closest color is still resolved per pixel
+        auto fnFillInside = [&](const PixelRect& block, const std::vector<uint32_t>& candidates)
+        {
+            const int offset = block.xMin - tileX;
+            const int count = block.xMax - block.xMin;
+            const int padded = SdfBatch::PaddedCount(count);
+
+            for (int y = block.yMin; y < block.yMax; y++)
+            {
+                std::fill_n(closestDistance, padded, 1e30f);
+                std::fill_n(pixelColor, padded, program.colors[candidates.front()].n);
+
+                if (candidates.size() > 1)
+                {
+                    for (uint32_t i : candidates)
+                    {
+                        fnRowCoordinates(i, y, offset + padded);
+                        SdfBatch::Evaluate(program.types[i], localU + offset, localV + offset, sdf, count);
+                        SdfBatch::SelectClosest(closestDistance, pixelColor, sdf, program.colors[i].n, count);
+                    }
+                }
+
+                olc::Pixel* surfaceRow = surface.Row(y) + block.xMin;
+                float* fieldRow = mDistanceField.data() + size_t(y) * mSurface->width + block.xMin;
+                for (int j = 0; j < count; j++)
+                {
+                    surfaceRow[j] = olc::Pixel(pixelColor[j]);
+                }
+                std::fill_n(fieldRow, count, -UnresolvedDistance);
+            }
+        };
+
+        // The combined field changes by at most lipschitz per pixel, as min, max and the smooth
+        // union never grow faster than their inputs
+        float lipschitz = 0.0f, magnitude = 0.0f;
+        for (uint32_t i : bin)
+        {
+            lipschitz = std::max(lipschitz, program.lipschitz[i]);
+            magnitude = std::max({ magnitude,
+                std::abs(program.ux[i]) * x1 + std::abs(program.uy[i]) * std::abs(y1 + mFirstRow) + std::abs(program.u0[i]),
+                std::abs(program.vx[i]) * x1 + std::abs(program.vy[i]) * std::abs(y1 + mFirstRow) + std::abs(program.v0[i]) });
         }
 
-        // Modifier test: Repetition
-        // rotatedPos.x = mod(rotatedPos.x + 5.0f, 10.0f) - 5.0f;
-        // rotatedPos.y = mod(rotatedPos.y + 5.0f, 10.0f) - 5.0f;
+        // Classification has to hold for the computed pixel values, so leave room for their rounding
+        const float rounding = 256.0f * FLT_EPSILON * magnitude;
+        auto fnTolerance = [&](float value)
+        {
+            return rounding + 1e-4f * (1.0f + std::abs(value));
+        };
+
+        // Coverage blends pixels within half a pixel of the edge, with the gradient taken from their
+        // neighbours, so the two pixels along every edge keep their exact distance
+        const float edgeReach = coverage ? 2.0f * lipschitz : 0.0f;
 
-        return rotatedPos;
-    };
+        // Coarse to fine: blocks entirely inside or outside are filled, the rest is rasterized as
+        // spans when edges are hard, or else split down to MinBlockSize and marked for per pixel evaluation
+        constexpr int MinBlockSize = 8;
+        constexpr int GridSize = RenderTileSize / MinBlockSize;
+        bool boundary[GridSize][GridSize] = {};
 
-    for (int y = 0; y < mSurface->height; y++)
-    {
-        for (int x = 0; x < mSurface->width; x++)
+        std::vector<float> centerSDF(bin.size());
+        std::vector<bool> contender(bin.size());
+        std::vector<uint32_t> candidates;
+        std::vector<PixelRect> blocks{ { x0, y0, x1, y1 } };
+
+        // Marks the elements that can be the closest one somewhere within radius of the block center
+        auto fnFindContenders = [&](float radius)
+        {
+            float closest = 1e30f;
+            for (size_t k = 0; k < bin.size(); k++)
+            {
+                uint32_t i = bin[k];
+                if (program.joins[i] == JoinOperation::Subtraction) continue;
+                closest = std::min(closest, centerSDF[k] + program.lipschitz[i] * radius + fnTolerance(centerSDF[k]));
+            }
+
+            for (size_t k = 0; k < bin.size(); k++)
+            {
+                uint32_t i = bin[k];
+                contender[k] = program.joins[i] != JoinOperation::Subtraction &&
+                    centerSDF[k] - program.lipschitz[i] * radius - fnTolerance(centerSDF[k]) <= closest;
+            }
+        };
+
+        // Hard edged blocks are rasterized row by row: every element is cut to the span it covers
+        // and the spans are combined with bit masks, so only pixels near an edge are evaluated
+        static_assert(RenderTileSize <= 32, "a block row has to fit in a 32 bit pixel mask");
+        std::vector<uint32_t> inner(bin.size());
+        alignas(64) uint32_t rowColor[RenderTileSize];
+
+        auto fnRenderSpans = [&](const PixelRect& block)
         {
-            // First pass: Find the closest non-subtractive element for color
-            float closestDistance = 1e30f;
-            olc::Pixel pixelColor{ 0, 0, 0, 0 };
-            
-            for (const auto& el : mElements)
+            const int width = block.xMax - block.xMin;
+            const uint32_t rowMask = (width == 32) ? ~0u : (1u << width) - 1u;
+
+            // Pixels of the row in [lo, hi], as a mask
+            auto fnSpanMask = [&](double lo, double hi)
+            {
+                double first = std::max(std::ceil(lo - block.xMin), 0.0);
+                double last = std::min(std::floor(hi - block.xMin), double(width - 1));
+                if (first > last) return 0u;
+                int count = int(last - first) + 1;
+                return ((count == 32) ? ~0u : (1u << count) - 1u) << int(first);
+            };
+
+            // Every element further than margin from its edge has the sign the boolean ops say. The
+            // leftover smoothness can pull the shape out a little at every union, which counts too.
+            int unions = 0;
+            for (uint32_t i : bin) unions += program.joins[i] == JoinOperation::Union;
+            const double margin = fnTolerance(1.0f) + edgeReach + unions * 0.3f * smoothness / (1.0f - std::sqrt(0.5f));
+
+            for (int y = block.yMin; y < block.yMax; y++)
             {
-                if (el->IsSubtractive()) continue; // Skip subtractive elements for color
-                
-                olc::vf2d rotatedPos = fnPixelsToNormalized(x, y, el.get());
-                float sdf = el->GetSDF(rotatedPos);
+                uint32_t shape = 0, edges = 0, once = 0, twice = 0;
+                bool firstElement = !leadingCulled;
 
-                if (sdf < closestDistance)
+                for (size_t k = 0; k < bin.size(); k++)
                 {
-                    closestDistance = sdf;
-                    pixelColor = el->GetColor();
+                    uint32_t i = bin[k];
+                    const double ax = double(program.uy[i]) * (y + mFirstRow) + program.u0[i];
+                    const double ay = double(program.vy[i]) * (y + mFirstRow) + program.v0[i];
+
+                    double lo, hi;
+                    PrimitiveSpan(program.types[i], ax, ay, program.ux[i], program.vx[i], -margin, lo, hi);
+                    inner[k] = fnSpanMask(lo, hi);
+                    PrimitiveSpan(program.types[i], ax, ay, program.ux[i], program.vx[i], margin, lo, hi);
+                    edges |= fnSpanMask(lo, hi) & ~inner[k];
+
+                    switch (program.joins[i])
+                    {
+                        case JoinOperation::Union:
+                            shape = firstElement ? inner[k] : (shape | inner[k]);
+                            firstElement = false;
+                            break;
+                        case JoinOperation::Intersection:
+                            shape = firstElement ? inner[k] : (shape & inner[k]);
+                            firstElement = false;
+                            break;
+                        case JoinOperation::Subtraction:
+                            shape &= ~inner[k];
+                            break;
+                    }
+
+                    if (contender[k])
+                    {
+                        twice |= once & inner[k];
+                        once |= inner[k];
+                    }
+                }
+
+                // Only elements covering a pixel can be the closest one there, so pixels covered by one
+                // contender take its color and only overlaps compare distances
+                const uint32_t inside = shape & ~edges & rowMask;
+                const uint32_t overlap = inside & twice;
+                for (size_t k = 0; k < bin.size(); k++)
+                {
+                    if (!contender[k]) continue;
+                    for (uint32_t bits = inner[k] & inside & ~twice; bits; bits &= bits - 1)
+                    {
+                        rowColor[std::countr_zero(bits)] = program.colors[bin[k]].n;
+                    }
+                }
+
+                if (overlap)
+                {
+                    const int first = std::countr_zero(overlap);
+                    const int offset = block.xMin - tileX + first;
+                    const int count = 32 - std::countl_zero(overlap) - first;
+                    const int padded = SdfBatch::PaddedCount(count);
+                    std::fill_n(closestDistance, padded, 1e30f);
+
+                    for (size_t k = 0; k < bin.size(); k++)
+                    {
+                        uint32_t i = bin[k];
+                        if (!contender[k] || !(inner[k] & overlap)) continue;
+                        fnRowCoordinates(i, y, offset + padded);
+                        SdfBatch::Evaluate(program.types[i], localU + offset, localV + offset, sdf, count);
+                        SdfBatch::SelectClosest(closestDistance, pixelColor, sdf, program.colors[i].n, count);
+                    }
+                    for (uint32_t bits = overlap; bits; bits &= bits - 1)
+                    {
+                        int j = std::countr_zero(bits);
+                        rowColor[j] = pixelColor[j - first];
+                    }
+                }
+
+                olc::Pixel* surfaceRow = surface.Row(y) + block.xMin;
+                float* fieldRow = mDistanceField.data() + size_t(y) * mSurface->width + block.xMin;
+                for (int j = 0; j < width; j++)
+                {
+                    bool covered = (inside >> j) & 1u;
+                    surfaceRow[j] = covered ? olc::Pixel(rowColor[j]) : olc::Pixel(0, 0, 0, 0);
+                    fieldRow[j] = covered ? -UnresolvedDistance : UnresolvedDistance;
+                }
+
+                // Runs of edge pixels get the full evaluation
+                for (uint32_t bits = edges & rowMask; bits;)
+                {
+                    int first = std::countr_zero(bits);
+                    int count = std::countr_one(bits >> first);
+                    fnRenderBlock({ block.xMin + first, y, block.xMin + first + count, y + 1 });
+                    bits = (first + count == 32) ? 0u : bits & (~0u << (first + count));
                 }
             }
+        };
 
-            // Second pass: Calculate the final SDF for the merged shape
-            float sdfAccum = 1e30f;
-            bool firstElement = true;
-            
-            for (const auto& el : mElements)
+        while (!blocks.empty())
+        {
+            PixelRect block = blocks.back();
+            blocks.pop_back();
+
+            const int w = block.xMax - block.xMin;
+            const int h = block.yMax - block.yMin;
+            const float cx = 0.5f * float(block.xMin + block.xMax - 1);
+            const float cy = 0.5f * float(block.yMin + block.yMax - 1 + 2 * mFirstRow);
+            const float radius = 0.5f * std::sqrt(float((w - 1) * (w - 1) + (h - 1) * (h - 1)));
+
+            float field = 1e30f;
+            bool firstElement = !leadingCulled;
+            for (size_t k = 0; k < bin.size(); k++)
             {
-                olc::vf2d rotatedPos = fnPixelsToNormalized(x, y, el.get());
-                float sdf = el->GetSDF(rotatedPos);
+                uint32_t i = bin[k];
+                float d = fnSDF(program.types[i], {
+                    program.ux[i] * cx + program.uy[i] * cy + program.u0[i],
+                    program.vx[i] * cx + program.vy[i] * cy + program.v0[i] });
+                centerSDF[k] = d;
 
-                switch (el->GetJoinOperation())
+                switch (program.joins[i])
                 {
                     case JoinOperation::Union:
-                        if (firstElement) {
-                            sdfAccum = sdf;
-                            firstElement = false;
-                        } else {
-                            sdfAccum = fnUnion(sdfAccum, sdf, mMergeSmoothness + 1e-3f);
-                        }
+                        field = firstElement ? d : fnUnion(field, d, smoothness);
+                        firstElement = false;
                         break;
                     case JoinOperation::Intersection:
-                        if (firstElement) {
-                            sdfAccum = sdf;
-                            firstElement = false;
-                        } else {
-                            sdfAccum = fnIntersection(sdfAccum, sdf);
-                        }
+                        field = firstElement ? d : std::max(field, d);
+                        firstElement = false;
                         break;
                     case JoinOperation::Subtraction:
-                        sdfAccum = fnSubtract(sdfAccum, sdf);
+                        field = std::max(field, -d);
                         break;
                 }
+            }
 
+            const float reach = lipschitz * radius + fnTolerance(field) + edgeReach;
+            if (field > reach)
+            {
+                // Fully outside
+                surface.Fill(block, olc::Pixel(0, 0, 0, 0));
+                for (int y = block.yMin; y < block.yMax; y++)
+                {
+                    std::fill_n(mDistanceField.data() + size_t(y) * mSurface->width + block.xMin, w, UnresolvedDistance);
+                }
             }
+            else if (field < -reach && withNormals)
+            {
+                // Fully inside, but every pixel still needs its gradient
+                fnRenderBlock(block);
+            }
+            else if (field < -reach)
+            {
+                // Fully inside, drop the elements that can never be the closest one anywhere in the block
+                fnFindContenders(radius);
+                candidates.clear();
+                for (size_t k = 0; k < bin.size(); k++)
+                {
+                    if (contender[k]) candidates.push_back(bin[k]);
+                }
+                fnFillInside(block, candidates);
+            }
+            else if (hardEdges)
+            {
+                fnFindContenders(radius);
+                fnRenderSpans(block);
+            }
+            else if (w <= MinBlockSize && h <= MinBlockSize)
+            {
+                boundary[(block.yMin - y0) / MinBlockSize][(block.xMin - x0) / MinBlockSize] = true;
+            }
+            else
+            {
+                // Split on the grid of the smallest blocks
+                int mx = block.xMin + std::max(w / 2 / MinBlockSize, 1) * MinBlockSize;
+                int my = block.yMin + std::max(h / 2 / MinBlockSize, 1) * MinBlockSize;
+                for (PixelRect child : {
+                    PixelRect{ block.xMin, block.yMin, mx, my }, PixelRect{ mx, block.yMin, block.xMax, my },
+                    PixelRect{ block.xMin, my, mx, block.yMax }, PixelRect{ mx, my, block.xMax, block.yMax } })
+                {
+                    child = child.Intersect(block);
+                    if (!child.IsEmpty()) blocks.push_back(child);
+                }
+            }
+        }
 
-            float inside = 1.0f - fnStep(sdfAccum, 0.0f);
-            if (inside < 1.0f)
+        // Neighbouring boundary blocks of a row are evaluated together, wider runs keep the vectors full
+        for (int by = 0; by * MinBlockSize < y1 - y0; by++)
+        {
+            for (int bx = 0; bx * MinBlockSize < x1 - x0;)
             {
-                mSurface->SetPixel(x, y, pixelColor);
+                if (!boundary[by][bx]) { bx++; continue; }
+
+                int runEnd = bx;
+                while (runEnd * MinBlockSize < x1 - x0 && boundary[by][runEnd]) runEnd++;
+
+                fnRenderBlock({
+                    x0 + bx * MinBlockSize, y0 + by * MinBlockSize,
+                    std::min(x0 + runEnd * MinBlockSize, x1), std::min(y0 + (by + 1) * MinBlockSize, y1) });
+                bx = runEnd;
             }
-            sdfMap[y * mSurface->width + x] = sdfAccum;
         }
-    }
+    });
 
-    // Compute normals
-    auto fnSampleSDF = [&](int x, int y)
-    {
-        if (x < 0 || x >= mSurface->width || y < 0 || y >= mSurface->height)
-            return 1e30f;
-        return sdfMap[y * mSurface->width + x];
-    };
+    // Coverage reads the finished distance field of the neighbours, so it is a second tiled pass.
+    // The distance field outside of the region is still valid from the last render.
+    auto fnSampleSDF = [&](int x, int y) { return GetDistance(x, y); };
 
-    const float e = 2.0f / mSurface->width;
-    for (int y = 0; y < mSurface->height; y++)
+    const float coverageReach = GetElementReach();
+    if (coverage) ForEachTile(workers, mSurface->width, region, [&](size_t, int x0, int y0, int x1, int y1)
     {
-        for (int x = 0; x < mSurface->width; x++)
+        for (int y = y0; y < y1; y++)
         {
-            float dx = fnSampleSDF(x + 1, y) - fnSampleSDF(x - 1, y);
-            float dy = fnSampleSDF(x, y + 1) - fnSampleSDF(x, y - 1);
-            vec3 n = vec3{ -dx, -dy, 2.0f * e }.norm();
-            mNormals->SetPixel(x, y, olc::PixelF(
-                n.x * 0.5f + 0.5f,
-                n.y * 0.5f + 0.5f,
-                n.z * 0.5f + 0.5f
-            ));
+            olc::Pixel* surfaceRow = surface.Row(y);
+            for (int x = x0; x < x1; x++)
+            {
+                float left = fnSampleSDF(x - 1, y), right = fnSampleSDF(x + 1, y);
+                float up = fnSampleSDF(x, y - 1), down = fnSampleSDF(x, y + 1);
+
+                // Distance to the edge in pixels gives the covered part of the pixel. Next to an
+                // unresolved pixel the edge is always further than that, so the sign decides. Beyond
+                // the element reach the field left from earlier renders may be out of date, the
+                // clamp keeps those values from mattering.
+                auto fnClamp = [&](float v) { return clamp(v, -coverageReach, coverageReach); };
+                float sdf = fnSampleSDF(x, y);
+                float alpha = (sdf < 0.0f) ? 1.0f : 0.0f;
+                if (std::max({ std::abs(left), std::abs(right), std::abs(up), std::abs(down) }) < UnresolvedDistance)
+                {
+                    float gx = fnClamp(right) - fnClamp(left);
+                    float gy = fnClamp(down) - fnClamp(up);
+                    float gradient = 0.5f * std::sqrt(gx * gx + gy * gy);
+                    if (gradient > 0.0f) alpha = clamp(0.5f - fnClamp(sdf) / gradient, 0.0f, 1.0f);
+                }
+
+                olc::Pixel& pixel = surfaceRow[x];
+                pixel = (alpha > 0.0f) ? olc::Pixel(pixel.r, pixel.g, pixel.b, uint8_t(pixel.a * alpha + 0.5f)) : olc::Pixel(0, 0, 0, 0);
+            }
         }
+    });
+
+    // Shading already ran along with the render, as coverage only scales alpha the order does not matter
+    if (mContourEffect->mEnabled)
+    {
+        ApplyEffect(*mContourEffect, region);
     }
 
-    if (mShadingEffect->mEnabled)
+    if (region.Contains(mDirtyRegion.Intersect(surfaceRect)))
     {
-        mShadingEffect->Apply(this);
+        mDirtyRegion = {};
     }
+}
 
-    if (mContourEffect->mEnabled)
+void Layer::Compile(RenderProgram& program) const
+{
+    const size_t count = mElements.size();
+    program.types.resize(count);
+    program.joins.resize(count);
+    program.colors.resize(count);
+    for (auto* v : { &program.ux, &program.uy, &program.u0, &program.vx, &program.vy, &program.v0, &program.lipschitz })
+        v->resize(count);
+
+    for (size_t i = 0; i < count; i++)
     {
-        mContourEffect->Apply(this);
+        const Element* el = mElements[i].get();
+        program.types[i] = el->GetType();
+        program.joins[i] = el->GetJoinOperation();
+        program.colors[i] = el->GetColor();
+
+        // Rotate by -rotation around the element position, then scale the size down to [-1, 1]
+        float cosAngle = std::cos(-el->GetRotation());
+        float sinAngle = std::sin(-el->GetRotation());
+
+        olc::vf2d scale{ el->GetSize().x / 2.0f, el->GetSize().y / 2.0f };
+        olc::vf2d invScale{ 1.0f, 1.0f };
+        if (scale.x > 0.0f && scale.y > 0.0f)
+        {
+            invScale = { 1.0f / scale.x, 1.0f / scale.y };
+        }
+
+        program.ux[i] = cosAngle * invScale.x;
+        program.uy[i] = -sinAngle * invScale.x;
+        program.vx[i] = sinAngle * invScale.y;
+        program.vy[i] = cosAngle * invScale.y;
+
+        // Primitive SDFs grow by at most 1 per normalized unit, the transform stretches pixels by the inverse scale
+        program.lipschitz[i] = std::max(invScale.x, invScale.y);
+
+        olc::vf2d position = el->GetPosition();
+        program.u0[i] = -(program.ux[i] * position.x + program.uy[i] * position.y);
+        program.v0[i] = -(program.vx[i] * position.x + program.vy[i] * position.y);
     }
 }
 
@@ -370,31 +1227,14 @@ void Layer::Deserialize(const json &in)
 
     // Deserialize elements
     mElements.clear();
+    mIndex.Clear();
     if (in.contains("elements")) {
         for (const auto &elementData : in["elements"])
         {
-            if (elementData.contains("type")) {
-                std::string type = elementData["type"];
-                Element* element = nullptr;
-                if (type == "ellipse")
-                {
-                    element = new EllipseElement();
-                }
-                else if (type == "rectangle")
-                {
-                    element = new RectangleElement();
-                }
-                else if (type == "triangle")
-                {
-                    element = new TriangleElement();
-                }
-                // Add other element types here as needed
-
-                if (element)
-                {
-                    element->Deserialize(elementData);
-                    AddElement(element);
-                }
+            Element* element = Primitives::Deserialize(elementData);
+            if (element)
+            {
+                AddElement(element);
             }
         }
     }
@@ -411,6 +1251,53 @@ void Layer::Deserialize(const json &in)
             mContourEffect->Deserialize(in["effects"]["contour"]);
         }
     }
+    Invalidate();
+}
+
+PixelRect Layer::TakeDirtyRegion()
+{
+    PixelRect region = mDirtyRegion;
+    mDirtyRegion = {};
+    return region;
+}
+
+std::unique_ptr<Layer> Layer::CloneScene() const
+{
+    auto scene = std::make_unique<Layer>();
+    scene->mID = mID;
+    scene->mName = mName;
+    scene->mMergeSmoothness = mMergeSmoothness;
+    scene->mEdgeMode = mEdgeMode;
+    scene->mShadingEffect = std::make_unique<ShadingEffect>(*mShadingEffect);
+    scene->mContourEffect = std::make_unique<ContourEffect>(*mContourEffect);
+
+    for (const auto& element : mElements)
+    {
+        scene->mElements.emplace_back(Primitives::Clone(*element));
+        scene->mElements.back()->mLayer = nullptr;
+    }
+    return scene;
+}
+
+void Layer::ApplyEffect(Effect& effect, const PixelRect& region)
+{
+    SpriteView(mEffectBuffers.source.get()).Copy(SpriteView(mSurface.get()), region);
+    effect.Apply(this, region);
+}
+
+void Layer::TakeSurfaces(Layer& other)
+{
+    mSurface = std::move(other.mSurface);
+    mNormals = std::move(other.mNormals);
+    mDistanceField = std::move(other.mDistanceField);
+    mEffectBuffers = std::move(other.mEffectBuffers);
+}
+
+float Layer::GetDistance(int x, int y) const
+{
+    if (!mSurface || x < 0 || x >= mSurface->width || y < 0 || y >= mSurface->height)
+        return UnresolvedDistance;
+    return mDistanceField[size_t(y) * mSurface->width + x];
 }
 
 std::vector<Element*> Layer::GetElements() const
@@ -423,7 +1310,7 @@ std::vector<Element*> Layer::GetElements() const
 
 Layer* Shaper::AddLayer()
 {
-    mLayers.push_back(std::make_unique<Layer>(mWidth, mHeight));
+    mLayers.push_back(std::make_unique<Layer>(mLayerSurfaces ? mWidth : 0, mLayerSurfaces ? mHeight : 0));
     mLayerOrder.push_back(mLayers.back()->GetID());
     return mLayers.back().get();
 }
@@ -482,18 +1369,26 @@ void Shaper::ReorderLayer(size_t id, size_t newIndex)
 
 void Shaper::RenderAll()
 {
+    // Layers that did not change keep their surface, reordering only changes how they are composed
     for (const auto &layer : mLayers)
     {
-        layer->Clear();
-        layer->Render();
+        if (layer->IsDirty())
+        {
+            layer->Render(layer->GetDirtyRegion(), mWorkers.get());
+        }
     }
 }
 
+void Shaper::SetWorkerCount(size_t count)
+{
+    mWorkers = std::make_shared<ThreadPool>(count);
+}
+
 void Shaper::Resize(int width, int height)
 {
     for (const auto &layer : mLayers)
     {
-        layer->Resize(width, height);
+        layer->Resize(mLayerSurfaces ? width : 0, mLayerSurfaces ? height : 0);
     }
 }
 
@@ -542,56 +1437,176 @@ void Shaper::Deserialize(const json &in)
     }
 }
 
-void Shaper::ExportPNG(const std::string &path)
+// Stream an export goes to, "-" is the standard output. Null if the file cannot be created.
+static std::ostream* OpenExportStream(const std::string& path, std::ofstream& file)
+{
+    if (path == "-")
+    {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        return &std::cout;
+    }
+
+    file.open(path, std::ios::binary);
+    return file.is_open() ? &file : nullptr;
+}
+
+bool Shaper::ExportImage(const std::string &path, ImageFormat format, EdgeMode edges, int level)
 {
-    if (mLayers.empty()) return;
+    if (mLayers.empty()) return false;
+
+    std::ofstream file;
+    std::ostream* stream = OpenExportStream(path, file);
+    if (!stream) return false;
 
     std::unique_ptr<olc::Sprite> out = std::make_unique<olc::Sprite>(mWidth, mHeight);
+
+    // Layers changing their edges re-render completely, and again once they get theirs back
+    std::vector<EdgeMode> previousEdges;
+    for (const auto& layer : mLayers)
+    {
+        previousEdges.push_back(layer->GetEdgeMode());
+        layer->SetEdgeMode(edges);
+    }
     RenderAll();
 
-    // compose final image 
+    // compose final image, premultiplied while blending and straight again for the encoder
     for (const auto& layerID : mLayerOrder)
     {
         Layer* layer = GetLayer(layerID);
         if (!layer) continue;
 
-        for (int y = 0; y < mHeight; y++)
+        Compositor::BlendOver(out.get(), layer->GetSurface(), { 0, 0, mWidth, mHeight });
+    }
+    Compositor::Unpremultiply(out->GetData(), size_t(mWidth) * mHeight);
+
+    // The writers take the composited sprite as it is, none of them keeps a copy of the whole image
+    bool written = false;
+    if (auto writer = ImageWriter::Create(format, *stream, mWidth, mHeight, level, mWorkers.get()))
+    {
+        written = writer->WriteRows(out->GetData(), mHeight) && writer->Finish();
+    }
+    else
+    {
+        // PNG without zlib. olc::Pixel is stored as RGBA bytes, so the sprite is already in the
+        // layout stb expects. stb compresses at level 5 and up.
+        auto fnWrite = [](void* context, void* data, int size)
         {
-            for (int x = 0; x < mWidth; x++)
-            {
-                olc::Pixel src = layer->GetSurface()->GetPixel(x, y);
-                olc::Pixel dst = out->GetPixel(x, y);
+            static_cast<std::ostream*>(context)->write(static_cast<const char*>(data), size);
+        };
+        stbi_write_png_compression_level = level;
+        written = stbi_write_png_to_func(fnWrite, stream, mWidth, mHeight, 4, out->GetData(), mWidth * 4) &&
+            stream->flush().good();
+    }
+
+    for (size_t i = 0; i < mLayers.size(); i++)
+    {
+        mLayers[i]->SetEdgeMode(previousEdges[i]);
+    }
+    return written;
+}
 
-                float alpha = src.a / 255.0f;
-                float invAlpha = 1.0f - alpha;
+bool Shaper::ExportImageStrips(const std::string &path, ImageFormat format, EdgeMode edges, int level, int stripHeight)
+{
+    if (mLayers.empty() || mWidth <= 0 || mHeight <= 0) return false;
+    stripHeight = std::clamp(stripHeight, 1, mHeight);
 
-                olc::Pixel result;
-                result.r = uint8_t(clamp(int(src.r * alpha + dst.r * invAlpha), 0, 255));
-                result.g = uint8_t(clamp(int(src.g * alpha + dst.g * invAlpha), 0, 255));
-                result.b = uint8_t(clamp(int(src.b * alpha + dst.b * invAlpha), 0, 255));
-                result.a = uint8_t(clamp(int(src.a + dst.a * invAlpha), 0, 255));
+    std::ofstream file;
+    std::ostream* stream = OpenExportStream(path, file);
+    if (!stream) return false;
 
-                out->SetPixel(x, y, result);
-            }
+    // Rendering has the workers of the drawing, the encoder gets as many of its own
+    ThreadPool encoders(GetWorkerCount());
+    std::unique_ptr<ImageWriter> writer = ImageWriter::Create(format, *stream, mWidth, mHeight, level, &encoders);
+    if (!writer)
+    {
+        // PNG without zlib is encoded from a single buffer, rendered by the layers themselves.
+        // Layers without surfaces get them for the export and lose them again afterwards.
+        file.close();
+        const bool layerSurfaces = mLayerSurfaces;
+        if (!layerSurfaces)
+        {
+            SetLayerSurfaces(true);
+            Resize(mWidth, mHeight);
+        }
+        const bool written = ExportImage(path, format, edges, level);
+        if (!layerSurfaces)
+        {
+            SetLayerSurfaces(false);
+            Resize(mWidth, mHeight);
         }
+        return written;
     }
 
-    std::vector<uint8_t> imageData;
-    imageData.reserve(mWidth * mHeight * 4); // RGBA
+    // Rows around a strip that its edges and effects look at, rendered but not written
+    std::vector<std::unique_ptr<Layer>> scenes;
+    int margin = 0;
+    for (const auto& layerID : mLayerOrder)
+    {
+        Layer* layer = GetLayer(layerID);
+        if (!layer) continue;
 
-    for (int y = 0; y < mHeight; y++)
+        scenes.push_back(layer->CloneScene());
+        scenes.back()->SetEdgeMode(edges);
+        margin = std::max(margin, scenes.back()->GetRenderMargin());
+    }
+
+    // One set of surfaces goes from scene to scene, so a strip of a single layer is rendered at a time
+    Layer surfaces;
+    auto fnRenderStrip = [&](int top, std::vector<olc::Pixel>& strip)
     {
-        for (int x = 0; x < mWidth; x++)
+        const int bottom = std::min(top + stripHeight, mHeight);
+        const int renderTop = std::max(top - margin, 0);
+        const int renderBottom = std::min(bottom + margin, mHeight);
+
+        // Same opaque black background as the new sprite ExportImage() composes onto
+        std::fill(strip.begin(), strip.end(), olc::Pixel());
+        for (const auto& scene : scenes)
         {
-            olc::Pixel pixel = out->GetPixel(x, y);
-            imageData.push_back(pixel.r);
-            imageData.push_back(pixel.g);
-            imageData.push_back(pixel.b);
-            imageData.push_back(pixel.a);
+            scene->TakeSurfaces(surfaces);
+            scene->SetFirstRow(renderTop);
+
+            // Pixels no element reaches are not rendered, so whatever the last scene left goes first
+            if (!scene->GetSurface() || scene->GetSurface()->height != renderBottom - renderTop)
+            {
+                scene->Resize(mWidth, renderBottom - renderTop);
+            }
+            else
+            {
+                scene->Clear();
+            }
+            scene->Render(mWorkers.get());
+
+            const SpriteView surface(scene->GetSurface());
+            for (int y = top; y < bottom; y++)
+            {
+                Compositor::BlendOver(strip.data() + size_t(y - top) * mWidth, surface.Row(y - renderTop), mWidth);
+            }
+            surfaces.TakeSurfaces(*scene);
         }
+        Compositor::Unpremultiply(strip.data(), size_t(bottom - top) * mWidth);
+    };
+
+    // The next strip renders on its own thread while the current one is encoded
+    std::vector<olc::Pixel> strips[2];
+    strips[0].resize(size_t(mWidth) * stripHeight);
+    strips[1].resize(size_t(mWidth) * stripHeight);
+
+    bool written = true;
+    std::future<void> next = std::async(std::launch::async, fnRenderStrip, 0, std::ref(strips[0]));
+    for (int top = 0, current = 0; top < mHeight && written; top += stripHeight, current ^= 1)
+    {
+        next.get();
+        if (top + stripHeight < mHeight)
+        {
+            next = std::async(std::launch::async, fnRenderStrip, top + stripHeight, std::ref(strips[current ^ 1]));
+        }
+        written = writer->WriteRows(strips[current].data(), std::min(stripHeight, mHeight - top));
     }
+    if (next.valid()) next.wait();
 
-    stbi_write_png(path.c_str(), mWidth, mHeight, 4, imageData.data(), mWidth * 4);
+    return written && writer->Finish();
 }
 
 Layer *Shaper::GetLayer(size_t id) const
@@ -615,7 +1630,7 @@ size_t Shaper::GetLayerOrder(size_t id) const
     return (it != mLayerOrder.end()) ? std::distance(mLayerOrder.begin(), it) : size_t(-1);
 }
 
-void ContourEffect::Apply(Layer *target)
+void ContourEffect::Apply(Layer *target, const PixelRect& region)
 {
     if (!target) return;
 
@@ -623,54 +1638,125 @@ void ContourEffect::Apply(Layer *target)
     auto surface = target->GetSurface();
     if (!surface) return;
 
-    // Create a copy of the original surface to avoid modifying it while reading
-    auto originalSurface = std::make_unique<olc::Sprite>(surface->width, surface->height);
-    for (int y = 0; y < surface->height; y++)
+    // Read the region from the effect source to avoid modifying it while reading
+    EffectBuffers& buffers = target->GetEffectBuffers();
+    const SpriteView view(surface);
+    const SpriteView source(buffers.source.get());
+    auto fnOriginal = [&](int x, int y)
+    {
+        return source.Row(y)[x];
+    };
+
+    // Pixels outside of the region already carry their contour, so pixels count as opaque only
+    // when they are covered by the shape itself. Edge pixels blended by coverage do not count either.
+    const std::vector<float>& field = target->GetDistanceField();
+    auto fnIsOpaque = [&](int x, int y)
     {
-        for (int x = 0; x < surface->width; x++)
+        if (field[y * surface->width + x] >= 0.0f) return false;
+        if (x >= region.xMin && x < region.xMax && y >= region.yMin && y < region.yMax)
+            return fnOriginal(x, y).a != 0;
+        return view.Row(y)[x].a != 0;
+    };
+
+    if (mThickness <= 0) return;
+
+    // Squared distance of every region pixel to the closest opaque pixel, as a separable Euclidean
+    // distance transform (Felzenszwalb and Huttenlocher) so any thickness costs the same.
+    // Opaque pixels further than the thickness away do not matter, so only a window around the region is scanned.
+    const int thickness = mThickness;
+    const int windowXMin = std::max(0, region.xMin - thickness);
+    const int windowXMax = std::min(surface->width, region.xMax + thickness);
+    const int windowYMin = std::max(0, region.yMin - thickness);
+    const int windowYMax = std::min(surface->height, region.yMax + thickness);
+    const int windowW = windowXMax - windowXMin;
+    const int farAway = thickness + 1;
+
+    // Vertical distance to the closest opaque pixel in the same column, from a sweep down and one up
+    int* columnDistance = buffers.columnDistance.data();
+    int* lastOpaque = buffers.lastOpaque.data();
+    for (int x = windowXMin; x < windowXMax; x++)
+    {
+        int last = -farAway - thickness;
+        for (int y = windowYMin; y < windowYMax; y++)
         {
-            originalSurface->SetPixel(x, y, surface->GetPixel(x, y));
+            if (fnIsOpaque(x, y)) last = y;
+            lastOpaque[y - windowYMin] = last;
+        }
+
+        last = windowYMax + farAway + thickness;
+        for (int y = windowYMax - 1; y >= windowYMin; y--)
+        {
+            if (lastOpaque[y - windowYMin] == y) last = y;
+            if (y >= region.yMin && y < region.yMax)
+            {
+                int distance = std::min(y - lastOpaque[y - windowYMin], last - y);
+                columnDistance[size_t(y - region.yMin) * windowW + (x - windowXMin)] = std::min(distance, farAway);
+            }
         }
     }
 
-    for (int y = 0; y < surface->height; y++)
+    // Per row, the lower envelope of the parabolas (x - q)^2 + g(q)^2 of the columns that have an opaque pixel close enough
+    int* parabolas = buffers.parabolas.data();
+    double* boundaries = buffers.boundaries.data();
+    int* rowDistance = buffers.rowDistance.data();
+    for (int y = region.yMin; y < region.yMax; y++)
     {
-        for (int x = 0; x < surface->width; x++)
+        const int* g = columnDistance + size_t(y - region.yMin) * windowW;
+        auto fnHeight = [&](int q) { return g[q] * g[q] + q * q; };
+
+        int count = 0;
+        for (int q = 0; q < windowW; q++)
         {
-            olc::Pixel color = originalSurface->GetPixel(x, y);
-            if (color.a == 0) // If the pixel is transparent
+            if (g[q] >= farAway) continue;
+
+            double start = -DBL_MAX;
+            while (count > 0)
             {
-                bool shouldDrawContour = false;
-                
-                // Check surrounding pixels within thickness radius
-                for (int dy = -mThickness; dy <= mThickness && !shouldDrawContour; dy++)
-                {
-                    for (int dx = -mThickness; dx <= mThickness && !shouldDrawContour; dx++)
-                    {
-                        if (dx == 0 && dy == 0) continue; // Skip center pixel
-                        
-                        // Check if within circular radius for smoother contours
-                        float distance = std::sqrt(dx * dx + dy * dy);
-                        if (distance > mThickness) continue;
-                        
-                        int nx = x + dx;
-                        int ny = y + dy;
-                        
-                        // Check bounds before accessing pixel
-                        if (nx >= 0 && nx < surface->width && ny >= 0 && ny < surface->height)
-                        {
-                            olc::Pixel neighbor = originalSurface->GetPixel(nx, ny);
-                            if (neighbor.a != 0) // If a neighboring pixel is opaque
-                            {
-                                shouldDrawContour = true;
-                            }
-                        }
-                    }
-                }
-                
+                const int v = parabolas[count - 1];
+                start = double(fnHeight(q) - fnHeight(v)) / double(2 * (q - v));
+                if (start > boundaries[count - 1]) break;
+                count--;
+            }
+            if (count == 0) start = -DBL_MAX;
+            parabolas[count] = q;
+            boundaries[count] = start;
+            count++;
+        }
+        boundaries[count] = DBL_MAX;
+
+        int k = 0;
+        for (int x = region.xMin; x < region.xMax; x++)
+        {
+            const int q = x - windowXMin;
+            if (count == 0)
+            {
+                rowDistance[x - region.xMin] = farAway * farAway;
+                continue;
+            }
+            while (boundaries[k + 1] < q) k++;
+            const int v = parabolas[k];
+            rowDistance[x - region.xMin] = (q - v) * (q - v) + g[v] * g[v];
+        }
+
+        olc::Pixel* row = view.Row(y);
+        for (int x = region.xMin; x < region.xMax; x++)
+        {
+            // Transparent pixels, and pixels outside of the shape that coverage only partly covers
+            olc::Pixel color = fnOriginal(x, y);
+            if (color.a == 0 || field[y * surface->width + x] >= 0.0f)
+            {
+                // Within the circular radius of an opaque pixel, for smoother contours
+                bool shouldDrawContour = rowDistance[x - region.xMin] <= thickness * thickness;
+
                 if (shouldDrawContour)
                 {
-                    surface->SetPixel(x, y, mColor);
+                    // A partly covered pixel goes over the contour
+                    float alpha = color.a / 255.0f;
+                    float contourAlpha = mColor.a / 255.0f * (1.0f - alpha);
+                    float total = alpha + contourAlpha;
+                    auto fnMix = [&](uint8_t a, uint8_t b) { return uint8_t((a * alpha + b * contourAlpha) / total + 0.5f); };
+                    row[x] = (color.a == 0) ? mColor : olc::Pixel(
+                        fnMix(color.r, mColor.r), fnMix(color.g, mColor.g), fnMix(color.b, mColor.b), uint8_t(total * 255.0f + 0.5f));
                 }
             }
         }
@@ -707,57 +1793,99 @@ void Effect::Deserialize(const json &in)
     }
 }
 
-void ShadingEffect::Apply(Layer *target)
+void EffectBuffers::Resize(int width, int height)
+{
+    // The distance transform works on at most the whole surface
+    source.reset(new olc::Sprite(width, height));
+    columnDistance.resize(size_t(width) * size_t(height));
+    lastOpaque.resize(height);
+    rowDistance.resize(width);
+    parabolas.resize(width);
+    boundaries.resize(size_t(width) + 1);
+}
+
+void ShadingEffect::Apply(Layer *target, const PixelRect& region)
 {
     if (!target) return;
 
     auto surface = target->GetSurface();
-    if (!surface) return;
+    if (!surface || !target->GetNormals()) return;
+
+    // Every pixel is shaded on its own, so the surface is shaded in place
+    const SpriteView view(surface);
+    const SpriteView normals(target->GetNormals());
+    const Palette palette = MakePalette();
 
-    auto fnStep = [](float a, float b)
+    for (int y = region.yMin; y < region.yMax; y++)
     {
-        return (a < b) ? 1.0f : 0.0f;
-    };
+        ShadeRow(palette, view.Row(y), normals.Row(y), view.Row(y), y + target->GetFirstRow(), region.xMin, region.xMax, surface->width);
+    }
+}
 
-    for (int y = 0; y < surface->height; y++)
+ShadingEffect::Palette ShadingEffect::MakePalette() const
+{
+    Palette palette;
+    for (int c = 0; c < 256; c++)
     {
-        for (int x = 0; x < surface->width; x++)
-        {
-            olc::Pixel originalColor = surface->GetPixel(x, y);
-            
-            // Skip transparent pixels
-            if (originalColor.a == 0) continue;
-            
-            // Calculate light direction: from pixel to light source
-            vec3 L{ float(mLightPosition.x - x), float(mLightPosition.y - y), float(surface->width) / 2.0f };
-            L = L.norm();
+        // Blend between the original color and the shadow color, then by the intensity
+        const olc::Pixel originalColor(c, c, c);
+        const olc::Pixel shadowedColor = olc::PixelLerp(originalColor, mColor, 0.7f);
+        const olc::Pixel lit = olc::PixelLerp(originalColor, originalColor, mIntensity);
+        const olc::Pixel shadowed = olc::PixelLerp(originalColor, shadowedColor, mIntensity);
+
+        palette.lit[c] = lit.r;
+        palette.shadowed[0][c] = shadowed.r;
+        palette.shadowed[1][c] = shadowed.g;
+        palette.shadowed[2][c] = shadowed.b;
+        palette.normal[c] = (static_cast<float>(c) / 255.0f) * 2.0f - 1.0f;
+    }
+    return palette;
+}
 
-            olc::Pixel normalMap = target->GetNormals()->GetPixel(x, y);
-            vec3 n{
-                (static_cast<float>(normalMap.r) / 255.0f) * 2.0f - 1.0f,
-                (static_cast<float>(normalMap.g) / 255.0f) * 2.0f - 1.0f,
-                (static_cast<float>(normalMap.b) / 255.0f) * 2.0f - 1.0f
-            };
+void ShadingEffect::ShadeRow(const Palette& palette, const olc::Pixel* source, const olc::Pixel* normals, olc::Pixel* out,
+    int y, int xMin, int xMax, int width) const
+{
+    constexpr int Chunk = 64;
+    static_assert(Chunk % SdfBatch::Padding == 0, "chunks are evaluated whole");
+    alignas(64) float nx[Chunk], ny[Chunk], nz[Chunk], lx[Chunk], light[Chunk];
 
-            // Calculate the lighting effect based on the light position
-            float lightIntensity = std::max(0.0f, n.dot(L));
+    // Light direction from pixel to light source, lifted above the surface by half its width
+    const float ly = float(mLightPosition.y - y);
+    const float lz = float(width) / 2.0f;
 
-            // Apply toon shading threshold
-            float intensity = fnStep(lightIntensity, 0.5f);
+    for (int x0 = xMin; x0 < xMax; x0 += Chunk)
+    {
+        const int count = std::min(Chunk, xMax - x0);
+        const int padded = SdfBatch::PaddedCount(count);
+        if (std::all_of(source + x0, source + x0 + count, [](olc::Pixel p) { return p.a == 0; }))
+        {
+            if (out != source) std::copy_n(source + x0, count, out + x0);
+            continue;
+        }
+
+        for (int j = 0; j < padded; j++)
+        {
+            olc::Pixel normalMap = (j < count) ? normals[x0 + j] : olc::Pixel(128, 128, 255);
+            nx[j] = palette.normal[normalMap.r];
+            ny[j] = palette.normal[normalMap.g];
+            nz[j] = palette.normal[normalMap.b];
+            lx[j] = float(mLightPosition.x - (x0 + j));
+        }
+        SdfBatch::Lighting(nx, ny, nz, lx, ly, lz, light, padded);
 
-            // Create shaded color: blend between original color and shadow color
-            olc::Pixel litColor = originalColor;
-            olc::Pixel shadowedColor = olc::PixelLerp(originalColor, mColor, 0.7f);
-            
-            // Choose between lit and shadowed based on intensity
-            olc::Pixel resultColor = intensity < 0.25f ? shadowedColor : litColor;
-            // olc::Pixel resultColor = olc::PixelLerp(litColor, shadowedColor, intensity);
+        for (int j = 0; j < count; j++)
+        {
+            olc::Pixel color = source[x0 + j];
 
-            // Apply final intensity blending
-            olc::Pixel finalColor = olc::PixelLerp(originalColor, resultColor, mIntensity);
-            finalColor.a = originalColor.a; // Preserve alpha
-            
-            surface->SetPixel(x, y, finalColor);
+            // Transparent pixels are left alone. Toon shading puts the pixels facing the light
+            // past the threshold in shadow.
+            if (color.a != 0)
+            {
+                color = (light[j] < 0.5f)
+                    ? olc::Pixel(palette.lit[color.r], palette.lit[color.g], palette.lit[color.b], color.a)
+                    : olc::Pixel(palette.shadowed[0][color.r], palette.shadowed[1][color.g], palette.shadowed[2][color.b], color.a);
+            }
+            out[x0 + j] = color;
         }
     }
 }
@@ -784,7 +1912,7 @@ void ShadingEffect::Deserialize(const json &in)
     }
 }
 
-float TriangleElement::GetSDF(olc::vf2d p) const
+float TriangleElement::SDF(olc::vf2d p)
 {
     // p is in normalized coordinates where the triangle should be a unit triangle
     // Simple triangle SDF - equilateral triangle with height 2 and base 2
@@ -843,9 +1971,3 @@ bool TriangleElement::IsPointInside(const olc::vi2d &point) const
     
     return (a >= 0.0f && b >= 0.0f && c >= 0.0f);
 }
-
-void TriangleElement::Serialize(json &out) const
-{
-    out["type"] = "triangle";
-    Element::Serialize(out);
-}
@@ -1,10 +1,17 @@
 #pragma once
 
 #include "olcPixelGameEngine.h"
+#include "image_writer.h"
+#include "png_encoder.h"
+#include "thread_pool.h"
 
 #include <string>
 #include <vector>
 #include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <climits>
+#include <cstdint>
 
 #include <nlohmann/json.hpp>
 using json = nlohmann::json;
@@ -44,6 +51,82 @@ struct vec3 {
     }
 };
 
+// Axis-aligned pixel rectangle, max is exclusive
+struct PixelRect {
+    int xMin{ 0 }, yMin{ 0 }, xMax{ 0 }, yMax{ 0 };
+
+    // Covers any pixel of any surface
+    static PixelRect Unbounded() {
+        return { INT_MIN / 2, INT_MIN / 2, INT_MAX / 2, INT_MAX / 2 };
+    }
+
+    bool IsEmpty() const { return xMax <= xMin || yMax <= yMin; }
+
+    bool Contains(const PixelRect& other) const {
+        return other.IsEmpty() ||
+            (other.xMin >= xMin && other.yMin >= yMin && other.xMax <= xMax && other.yMax <= yMax);
+    }
+
+    PixelRect Intersect(const PixelRect& other) const {
+        return {
+            std::max(xMin, other.xMin), std::max(yMin, other.yMin),
+            std::min(xMax, other.xMax), std::min(yMax, other.yMax)
+        };
+    }
+
+    PixelRect Union(const PixelRect& other) const {
+        if (IsEmpty()) return other;
+        if (other.IsEmpty()) return *this;
+        return {
+            std::min(xMin, other.xMin), std::min(yMin, other.yMin),
+            std::max(xMax, other.xMax), std::max(yMax, other.yMax)
+        };
+    }
+
+    PixelRect Expand(int amount) const {
+        return { xMin - amount, yMin - amount, xMax + amount, yMax + amount };
+    }
+};
+
+// Row access to the pixels of a sprite, skipping the bounds and sample mode checks of
+// olc::Sprite::GetPixel/SetPixel. Callers keep their coordinates inside the sprite.
+class SpriteView {
+public:
+    explicit SpriteView(olc::Sprite* sprite)
+        : mPixels(sprite->GetData()), mWidth(sprite->width), mHeight(sprite->height) {}
+
+    int GetWidth() const { return mWidth; }
+    int GetHeight() const { return mHeight; }
+
+    olc::Pixel* Row(int y) const { return mPixels + size_t(y) * size_t(mWidth); }
+
+    void Fill(olc::Pixel color) const
+    {
+        std::fill_n(mPixels, size_t(mWidth) * size_t(mHeight), color);
+    }
+
+    void Fill(const PixelRect& rect, olc::Pixel color) const
+    {
+        for (int y = rect.yMin; y < rect.yMax; y++)
+        {
+            std::fill_n(Row(y) + rect.xMin, rect.xMax - rect.xMin, color);
+        }
+    }
+
+    // Copies rect from a sprite of the same size
+    void Copy(const SpriteView& from, const PixelRect& rect) const
+    {
+        for (int y = rect.yMin; y < rect.yMax; y++)
+        {
+            std::copy_n(from.Row(y) + rect.xMin, rect.xMax - rect.xMin, Row(y) + rect.xMin);
+        }
+    }
+
+private:
+    olc::Pixel* mPixels;
+    int mWidth, mHeight;
+};
+
 class ISerializable {
 public:
     virtual void Serialize(json& out) const = 0;
@@ -56,6 +139,19 @@ enum class JoinOperation : int {
     Subtraction
 };
 
+// How a layer turns the distance field into pixels: hard edges for pixel art, or alpha from the
+// part of every pixel the shape covers
+enum class EdgeMode : uint8_t {
+    Hard = 0,
+    Coverage
+};
+
+enum class PrimitiveType : uint8_t {
+    Ellipse = 0,
+    Rectangle,
+    Triangle
+};
+
 struct ElementParams {
     olc::vi2d position{ 0, 0 };
     olc::vi2d size{ 1, 1 };
@@ -64,6 +160,8 @@ struct ElementParams {
     JoinOperation joinOperation{ JoinOperation::Union };
 };
 
+class Layer;
+
 class Element : public ISerializable {
 public:
     Element() = default;
@@ -78,19 +176,23 @@ public:
         mID = mNextID++;
     }
 
+    virtual PrimitiveType GetType() const = 0;
     virtual float GetSDF(olc::vf2d p) const = 0;
     virtual bool IsPointInside(const olc::vi2d& point) const = 0;
 
+    // Conservative pixel bounds of the area where GetSDF() < reach (reach is in normalized units)
+    PixelRect GetBounds(float reach = 0.0f) const;
+
     virtual void Serialize(json& out) const override;
     virtual void Deserialize(const json& in) override;
 
-    void SetPosition(const olc::vi2d& position) { mPosition = position; }
+    void SetPosition(const olc::vi2d& position) { mPosition = position; Moved(); }
     olc::vi2d GetPosition() const { return mPosition; }
 
     olc::vi2d GetSize() const { return mSize; }
-    void SetSize(const olc::vi2d& size) { mSize = size; }
+    void SetSize(const olc::vi2d& size) { mSize = size; Moved(); }
 
-    void SetRotation(float rotation) { mRotation = rotation; }
+    void SetRotation(float rotation) { mRotation = rotation; Moved(); }
     float GetRotation() const { return mRotation; }
 
     void SetColor(const olc::Pixel& color) { mColor = color; }
@@ -111,10 +213,14 @@ public:
         mRotation = params.rotation;
         mColor = params.color;
         mJoinOp = params.joinOperation;
+        Moved();
     }
 
     size_t GetID() const { return mID; }
 
+    // Layer the element was added to, nullptr for loose elements and render copies
+    Layer* GetLayer() const { return mLayer; }
+
     olc::vi2d mPosition{ 0, 0 };
     olc::vi2d mSize{ 1, 1 };
     float mRotation{ 0.0f };
@@ -122,12 +228,22 @@ public:
     JoinOperation mJoinOp{ JoinOperation::Union };
     
 private:
+    friend class Layer;
+
+    // Keeps the picking index of the owning layer in step with the element geometry.
+    // Writing the members directly skips it, SetParams() afterwards catches up.
+    void Moved();
+
     size_t mID;
     static size_t mNextID;
+    Layer* mLayer{ nullptr };
 };
 
 class EllipseElement : public Element {
 public:
+    static constexpr PrimitiveType Type = PrimitiveType::Ellipse;
+    static constexpr const char* Name = "ellipse";
+
     EllipseElement() = default;
     EllipseElement(
         const olc::vi2d& position,
@@ -136,14 +252,19 @@ public:
         const olc::Pixel& color
     ) : Element(position, size, rotation, color) {}
 
-    float GetSDF(olc::vf2d p) const override;
-    bool IsPointInside(const olc::vi2d& point) const override;
+    // SDF of the primitive in normalized coordinates
+    static float SDF(olc::vf2d p);
 
-    virtual void Serialize(json& out) const override;
+    PrimitiveType GetType() const override { return Type; }
+    float GetSDF(olc::vf2d p) const override { return SDF(p); }
+    bool IsPointInside(const olc::vi2d& point) const override;
 };
 
 class RectangleElement : public Element {
 public:
+    static constexpr PrimitiveType Type = PrimitiveType::Rectangle;
+    static constexpr const char* Name = "rectangle";
+
     RectangleElement() = default;
     RectangleElement(
         const olc::vi2d& position,
@@ -152,15 +273,20 @@ public:
         const olc::Pixel& color
     ) : Element(position, size, rotation, color) {}
 
-    float GetSDF(olc::vf2d p) const override;
-    bool IsPointInside(const olc::vi2d& point) const override;
+    // SDF of the primitive in normalized coordinates
+    static float SDF(olc::vf2d p);
 
-    virtual void Serialize(json& out) const override;
+    PrimitiveType GetType() const override { return Type; }
+    float GetSDF(olc::vf2d p) const override { return SDF(p); }
+    bool IsPointInside(const olc::vi2d& point) const override;
 };
 
 // Isosceles triangle
 class TriangleElement : public Element {
 public:
+    static constexpr PrimitiveType Type = PrimitiveType::Triangle;
+    static constexpr const char* Name = "triangle";
+
     TriangleElement() = default;
     TriangleElement(
         const olc::vi2d& position,
@@ -169,20 +295,135 @@ public:
         const olc::Pixel& color
     ) : Element(position, size, rotation, color) {}
 
-    float GetSDF(olc::vf2d p) const override;
+    // SDF of the primitive in normalized coordinates
+    static float SDF(olc::vf2d p);
+
+    PrimitiveType GetType() const override { return Type; }
+    float GetSDF(olc::vf2d p) const override { return SDF(p); }
     bool IsPointInside(const olc::vi2d& point) const override;
+};
 
-    virtual void Serialize(json& out) const override;
+// Compile-time list of every primitive, used wherever elements are created by type
+template <class... Ts>
+struct PrimitiveRegistry {
+    static constexpr size_t Count = sizeof...(Ts);
+
+    // Serialized type name of a primitive, nullptr if unknown
+    static const char* GetName(PrimitiveType type)
+    {
+        const char* name = nullptr;
+        ((type == Ts::Type ? name = Ts::Name : name), ...);
+        return name;
+    }
+
+    // Creates an empty element from its serialized type name, nullptr if unknown
+    static Element* Create(const std::string& name)
+    {
+        Element* element = nullptr;
+        ((element == nullptr && name == Ts::Name ? element = new Ts() : element), ...);
+        return element;
+    }
+
+    // Copy of an element with the same ID
+    static Element* Clone(const Element& element)
+    {
+        Element* copy = nullptr;
+        ((element.GetType() == Ts::Type ? copy = new Ts(static_cast<const Ts&>(element)) : copy), ...);
+        return copy;
+    }
+
+    // Creates and deserializes an element from its JSON, nullptr if the type is missing or unknown
+    static Element* Deserialize(const json& in)
+    {
+        if (!in.contains("type")) return nullptr;
+
+        Element* element = Create(in["type"].get<std::string>());
+        if (element)
+        {
+            element->Deserialize(in);
+        }
+        return element;
+    }
 };
 
-class Layer;
+using Primitives = PrimitiveRegistry<EllipseElement, RectangleElement, TriangleElement>;
+
+// Layer elements flattened for rasterization, one entry per element in layer order
+struct RenderProgram {
+    std::vector<PrimitiveType> types;
+    std::vector<JoinOperation> joins;
+    std::vector<olc::Pixel> colors;
+
+    // Inverse affine transform from pixels to normalized element coordinates:
+    // u = ux * x + uy * y + u0, v = vx * x + vy * y + v0
+    std::vector<float> ux, uy, u0;
+    std::vector<float> vx, vy, v0;
+
+    // Upper bound on how much the element SDF changes per pixel
+    std::vector<float> lipschitz;
+
+    size_t Size() const { return types.size(); }
+};
+
+// Uniform grid over element bounds for picking. Each element is listed in every cell its bounds
+// overlap, along with the order it was added in, so the topmost one at a point is found without
+// walking the whole layer.
+class ElementIndex {
+public:
+    void Insert(Element* element);
+    void Update(Element* element);
+    void Remove(const Element* element);
+    void Clear();
+
+    // Topmost element whose shape contains point, nullptr if there is none
+    Element* FindAt(const olc::vi2d& point) const;
+
+    // Elements whose bounds overlap area, bottom to top
+    std::vector<Element*> FindIn(const PixelRect& area) const;
+
+private:
+    static constexpr int CellSize = 64;
+
+    struct Entry {
+        Element* element;
+        PixelRect bounds;
+        uint64_t order;
+    };
+
+    // Cells covered by bounds, false for elements without a size that can be anywhere
+    static bool GetCells(const PixelRect& bounds, PixelRect& cells);
+    static uint64_t CellKey(int cx, int cy);
+
+    void Link(const Entry& entry);
+    void Unlink(const Entry& entry);
+
+    std::unordered_map<uint64_t, std::vector<Entry>> mCells;
+    std::unordered_map<const Element*, Entry> mEntries;
+    std::vector<Entry> mUnbounded;
+    uint64_t mNextOrder{ 0 };
+};
+
+// Scratch memory of the effect stack of a layer. It is sized with the layer and reused between
+// renders, so effects do not allocate while editing.
+struct EffectBuffers {
+    // Before each effect runs, the pixels of the region as they were before it. The effect reads
+    // from here and writes to the surface.
+    std::unique_ptr<olc::Sprite> source;
+
+    // Distance transform of the contour: per column and per row distances, and the lower envelope
+    std::vector<int> columnDistance, lastOpaque, rowDistance, parabolas;
+    std::vector<double> boundaries;
+
+    void Resize(int width, int height);
+};
 
 class Effect : public ISerializable {
 public:
     Effect() = default;
     virtual ~Effect() = default;
 
-    virtual void Apply(Layer* target) = 0;
+    // Applies the effect to the pixels of region, which were all just rendered
+    virtual void Apply(Layer* target, const PixelRect& region) = 0;
     virtual void Serialize(json& out) const override;
     virtual void Deserialize(const json& in) override;
 
@@ -191,7 +432,7 @@ public:
 
 class ContourEffect : public Effect {
 public:
-    void Apply(Layer* target) override;
+    void Apply(Layer* target, const PixelRect& region) override;
     void Serialize(json& out) const override;
     void Deserialize(const json& in) override;
 
@@ -201,10 +442,24 @@ public:
 
 class ShadingEffect : public Effect {
 public:
-    void Apply(Layer* target) override;
+    void Apply(Layer* target, const PixelRect& region) override;
     void Serialize(json& out) const override;
     void Deserialize(const json& in) override;
 
+    // Lookup tables for a whole render, the colors only depend on the channel value as mColor
+    // and mIntensity are the same for every pixel
+    struct Palette {
+        uint8_t lit[256];
+        uint8_t shadowed[3][256];
+        float normal[256];
+    };
+    Palette MakePalette() const;
+
+    // Shades the pixels [xMin, xMax) of a surface row showing row y of a drawing of the given
+    // width. The rows start at x = 0, and source and out may be the same row.
+    void ShadeRow(const Palette& palette, const olc::Pixel* source, const olc::Pixel* normals, olc::Pixel* out,
+        int y, int xMin, int xMax, int width) const;
+
     float mIntensity{ 0.5f };
     olc::Pixel mColor{ 0, 0, 0, 255 };
     olc::vi2d mLightPosition{ 0, 0 };
@@ -234,7 +489,50 @@ public:
     void Resize(int width, int height);
     void Clear();
 
-    void Render();
+    // Renders the layer in tiles, spread across workers when given
+    void Render(ThreadPool* workers = nullptr);
+
+    // Re-renders only the pixels a change inside dirty can affect, the rest of the
+    // surface is kept from the previous render
+    void Render(const PixelRect& dirty, ThreadPool* workers = nullptr);
+
+    // Pixels a render of dirty rewrites, which reach past it by what the effects and coverage look at
+    PixelRect GetRenderRegion(const PixelRect& dirty) const;
+
+    // How far around a pixel the edges and effects look, in pixels
+    int GetRenderMargin() const;
+
+    // Marks the whole layer, or only a part of it, as out of date with its surface.
+    // Every invalidation bumps the layer generation.
+    void Invalidate();
+    void Invalidate(const PixelRect& region);
+
+    bool IsDirty() const { return !mDirtyRegion.IsEmpty(); }
+    PixelRect GetDirtyRegion() const { return mDirtyRegion; }
+    uint64_t GetGeneration() const { return mGeneration; }
+
+    // Returns the dirty region and hands the responsibility of re-rendering it to the caller
+    PixelRect TakeDirtyRegion();
+
+    // Copy of the elements and settings without any surfaces or picking index, safe to hand to another thread
+    std::unique_ptr<Layer> CloneScene() const;
+
+    // Moves the surface, normals and distance field of another layer into this one
+    void TakeSurfaces(Layer& other);
+
+    // Row of the drawing shown by the top of the surface. Scenes rendering a horizontal strip of
+    // the drawing into a surface as wide as the drawing set it, layers of a drawing keep it at 0.
+    void SetFirstRow(int row) { if (row != mFirstRow) { mFirstRow = row; Invalidate(); } }
+    int GetFirstRow() const { return mFirstRow; }
+
+    // Pixel area an element can affect when rendered in this layer
+    PixelRect GetElementBounds(const Element* element) const;
+
+    // Topmost element under a drawing position, nullptr if there is none
+    Element* GetElementAt(const olc::vi2d& point) const { return mIndex.FindAt(point); }
+
+    // Elements whose bounds overlap area, in layer order
+    std::vector<Element*> GetElementsIn(const PixelRect& area) const { return mIndex.FindIn(area); }
 
     void Serialize(json& out) const override;
     void Deserialize(const json& in) override;
@@ -257,20 +555,56 @@ public:
     }
 
     float GetMergeSmoothness() const { return mMergeSmoothness; }
-    void SetMergeSmoothness(float smoothness) { mMergeSmoothness = smoothness; }
+    void SetMergeSmoothness(float smoothness) { mMergeSmoothness = smoothness; Invalidate(); }
+
+    EdgeMode GetEdgeMode() const { return mEdgeMode; }
+    void SetEdgeMode(EdgeMode mode) { if (mode != mEdgeMode) { mEdgeMode = mode; Invalidate(); } }
 
     std::vector<Element*> GetElements() const;
     olc::Sprite* GetSurface() const { return mSurface.get(); }
+
+    // Normal map of the distance field, only kept while shading is enabled and only written
+    // for covered pixels of the last rendered regions. Null otherwise.
     olc::Sprite* GetNormals() const { return mNormals.get(); }
+
+    // Distance field value off the surface, and with opposite sign inside, of pixels only
+    // classified as inside or outside without evaluating their distance
+    static constexpr float UnresolvedDistance = 1e30f;
+
+    // Signed distance of every surface pixel from the last render, row by row, in the normalized
+    // units of the closest element. Exact near every edge, and inside the shape on layers with shading;
+    // elsewhere pixels may be +/-UnresolvedDistance. Kept between renders and resized with the layer.
+    const std::vector<float>& GetDistanceField() const { return mDistanceField; }
+
+    EffectBuffers& GetEffectBuffers() { return mEffectBuffers; }
+
+    // Distance at a pixel, UnresolvedDistance off the surface
+    float GetDistance(int x, int y) const;
     size_t GetID() const { return mID; }
 
 private:
+    friend class Element;
+
+    float GetElementReach() const;
+    void Compile(RenderProgram& program) const;
+    void ApplyEffect(Effect& effect, const PixelRect& region);
+
     std::vector<std::unique_ptr<Element>> mElements;
+    ElementIndex mIndex;
     std::unique_ptr<olc::Sprite> mSurface, mNormals;
 
+    // Signed distance of every pixel from the last render, kept for partial re-renders
+    std::vector<float> mDistanceField;
+    EffectBuffers mEffectBuffers;
+
+    PixelRect mDirtyRegion{ PixelRect::Unbounded() };
+    uint64_t mGeneration{ 0 };
+
     std::unique_ptr<ShadingEffect> mShadingEffect;
     std::unique_ptr<ContourEffect> mContourEffect;
     float mMergeSmoothness{ 0.0f };
+    EdgeMode mEdgeMode{ EdgeMode::Hard };
+    int mFirstRow{ 0 };
 
     size_t mID;
     std::string mName{ "Layer" };
@@ -291,13 +625,40 @@ public:
     Layer* MoveLayerDown(size_t id);
     void ReorderLayer(size_t id, size_t newIndex);
 
+    // Renders the dirty part of every layer
     void RenderAll();
     void Resize(int width, int height);
 
+    // Layers without surfaces only hold their scene, for drawings loaded just to be exported with
+    // ExportImageStrips(). Applies to layers added or resized afterwards.
+    void SetLayerSurfaces(bool enabled) { mLayerSurfaces = enabled; }
+
+    // Number of threads used for rendering, 0 = one per hardware core
+    void SetWorkerCount(size_t count);
+    size_t GetWorkerCount() const { return mWorkers->GetThreadCount(); }
+
+    // The pool rendering runs on, shared with the render thread of the editor
+    std::shared_ptr<ThreadPool> GetWorkers() const { return mWorkers; }
+
     void Serialize(json& out) const override;
     void Deserialize(const json& in) override;
 
-    void ExportPNG(const std::string& path);
+    // Renders every layer with the given edges and writes the composited drawing in format, to
+    // the standard output if path is "-". PNG is deflated at a zlib level from 0 (fastest) to 9
+    // (smallest). Returns false if the image could not be written.
+    bool ExportImage(const std::string& path, ImageFormat format, EdgeMode edges = EdgeMode::Hard,
+        int level = PngEncoder::DefaultLevel);
+
+    void ExportPNG(const std::string& path, EdgeMode edges = EdgeMode::Hard, int level = PngEncoder::DefaultLevel) {
+        ExportImage(path, ImageFormat::PNG, edges, level);
+    }
+
+    // Same image as ExportImage() for drawings of any size. Copies of the layers render the drawing
+    // in strips of stripHeight rows which are encoded while the next strip renders, so memory only
+    // grows with the width. The layers of the drawing are left as they are. PNG needs zlib, other
+    // builds fall back to ExportImage() for it.
+    bool ExportImageStrips(const std::string& path, ImageFormat format, EdgeMode edges = EdgeMode::Hard,
+        int level = PngEncoder::DefaultLevel, int stripHeight = 64);
 
     int GetWidth() const { return mWidth; }
     int GetHeight() const { return mHeight; }
@@ -309,6 +670,8 @@ public:
 private:
     std::vector<std::unique_ptr<Layer>> mLayers;
     std::vector<size_t> mLayerOrder;
+    std::shared_ptr<ThreadPool> mWorkers{ std::make_shared<ThreadPool>() };
     int mWidth{ 100 };
     int mHeight{ 100 };
+    bool mLayerSurfaces{ true };
 };
\ No newline at end of file
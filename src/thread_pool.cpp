@@ -0,0 +1,91 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t threadCount)
+{
+    if (threadCount == 0)
+    {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (size_t i = 1; i < threadCount; i++)
+    {
+        mWorkers.emplace_back(&ThreadPool::WorkerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop = true;
+    }
+    mWake.notify_all();
+
+    for (auto& worker : mWorkers)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& task)
+{
+    if (count == 0) return;
+
+    // Nothing to share, run inline
+    if (mWorkers.empty() || count == 1)
+    {
+        for (size_t i = 0; i < count; i++)
+            task(i);
+        return;
+    }
+
+    std::lock_guard<std::mutex> job(mJobMutex);
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mTask = &task;
+        mTaskCount = count;
+        mNextTask = 0;
+        mActiveWorkers = mWorkers.size();
+        mJobID++;
+    }
+    mWake.notify_all();
+
+    RunTasks();
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mDone.wait(lock, [this] { return mActiveWorkers == 0; });
+    mTask = nullptr;
+}
+
+void ThreadPool::WorkerLoop()
+{
+    uint64_t lastJob = 0;
+    while (true)
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mWake.wait(lock, [&] { return mStop || mJobID != lastJob; });
+        if (mStop) return;
+
+        lastJob = mJobID;
+        lock.unlock();
+
+        RunTasks();
+
+        lock.lock();
+        if (--mActiveWorkers == 0)
+        {
+            mDone.notify_all();
+        }
+    }
+}
+
+void ThreadPool::RunTasks()
+{
+    size_t index;
+    while ((index = mNextTask.fetch_add(1)) < mTaskCount)
+    {
+        (*mTask)(index);
+    }
+}
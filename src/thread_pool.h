@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+
+// Persistent pool of worker threads used to split rendering work into independent tasks.
+// The calling thread takes part in every job, so a pool of N threads spawns N - 1 workers.
+class ThreadPool {
+public:
+    // threadCount == 0 picks one thread per hardware core
+    explicit ThreadPool(size_t threadCount = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Runs task(0) .. task(count - 1) across the pool and blocks until all of them are done.
+    // Tasks must be independent of each other. Calls from different threads take turns, but it
+    // is not re-entrant: do not call from inside a task.
+    void ParallelFor(size_t count, const std::function<void(size_t)>& task);
+
+    size_t GetThreadCount() const { return mWorkers.size() + 1; }
+
+private:
+    void WorkerLoop();
+    void RunTasks();
+
+    std::vector<std::thread> mWorkers;
+
+    // Held for a whole job, so only one caller at a time hands out tasks
+    std::mutex mJobMutex;
+
+    std::mutex mMutex;
+    std::condition_variable mWake, mDone;
+
+    const std::function<void(size_t)>* mTask{ nullptr };
+    size_t mTaskCount{ 0 };
+    std::atomic<size_t> mNextTask{ 0 };
+
+    size_t mActiveWorkers{ 0 };
+    uint64_t mJobID{ 0 };
+    bool mStop{ false };
+};
@@ -0,0 +1,796 @@
+#define OLC_PGE_APPLICATION
+#include "compositor.h"
+#include "history.h"
+#include "image_writer.h"
+#include "png_encoder.h"
+#include "sdf_batch.h"
+#include "shaper.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef PIXELSHAPER_ZLIB
+#include <zlib.h>
+#endif
+
+// Regression scenes for the layer renderer. Every test returns an empty string when it passes,
+// or what went wrong.
+
+static int CountCovered(const Layer* layer)
+{
+    olc::Sprite* surface = layer->GetSurface();
+    int covered = 0;
+    for (int i = 0; i < surface->width * surface->height; i++)
+    {
+        covered += surface->GetData()[i].a != 0;
+    }
+    return covered;
+}
+
+// A tile that culls the leading element must not let a later intersection start the shape: the
+// intersection of a small rectangle with a large ellipse stays within the rectangle
+static std::string TestCulledIntersection()
+{
+    const EdgeMode edgeModes[] = { EdgeMode::Hard, EdgeMode::Coverage };
+    for (EdgeMode edgeMode : edgeModes)
+    {
+        for (int variant = 0; variant < 3; variant++)
+        {
+            Shaper shaper(256, 256);
+            Layer* layer = shaper.AddLayer();
+            layer->SetEdgeMode(edgeMode);
+            if (variant == 1) layer->SetMergeSmoothness(0.5f);
+            if (variant == 2) layer->GetShadingEffect()->mEnabled = true;
+
+            ElementParams params;
+            params.position = { 40, 40 };
+            params.size = { 20, 20 };
+            Element* rectangle = layer->AddElement(new RectangleElement());
+            rectangle->SetParams(params);
+
+            params.position = { 128, 128 };
+            params.size = { 240, 240 };
+            params.joinOperation = JoinOperation::Intersection;
+            layer->AddElement(new EllipseElement())->SetParams(params);
+
+            shaper.RenderAll();
+
+            // Coverage reaches a pixel past the edge
+            const PixelRect bounds = layer->GetElementBounds(rectangle).Expand(1);
+            olc::Sprite* surface = layer->GetSurface();
+            for (int y = 0; y < surface->height; y++)
+            {
+                for (int x = 0; x < surface->width; x++)
+                {
+                    if (surface->GetPixel(x, y).a != 0 && !bounds.Contains(PixelRect{ x, y, x + 1, y + 1 }))
+                    {
+                        return "covered pixel at " + std::to_string(x) + "," + std::to_string(y) + " outside of the rectangle, variant " +
+                            std::to_string(variant) + (edgeMode == EdgeMode::Coverage ? " with coverage" : "");
+                    }
+                }
+            }
+            if (CountCovered(layer) == 0) return "the intersection is empty";
+        }
+    }
+    return {};
+}
+
+// Re-rendering the dirty part of a layer while an element is dragged has to give the same pixels
+// as rendering the scene from scratch, with every effect and join and either edge mode
+static std::string TestPartialRender()
+{
+    const EdgeMode edgeModes[] = { EdgeMode::Hard, EdgeMode::Coverage };
+    for (EdgeMode edgeMode : edgeModes)
+    {
+        for (unsigned seed = 0; seed < 200; seed++)
+        {
+            std::mt19937 rng(seed);
+            auto fnInt = [&](int lo, int hi) { return std::uniform_int_distribution<int>(lo, hi)(rng); };
+            auto fnFloat = [&](float lo, float hi) { return std::uniform_real_distribution<float>(lo, hi)(rng); };
+
+            const int width = fnInt(40, 200), height = fnInt(40, 200);
+            const float smoothness = fnInt(0, 1) ? fnFloat(0.0f, 1.0f) : 0.0f;
+            const bool shading = fnInt(0, 1), contour = fnInt(0, 1);
+            const int thickness = fnInt(1, 6);
+
+            std::vector<PrimitiveType> types;
+            std::vector<ElementParams> scene;
+            for (int i = fnInt(1, 10); i > 0; i--)
+            {
+                ElementParams params;
+                params.position = { fnInt(0, width), fnInt(0, height) };
+                params.size = { fnInt(4, 80), fnInt(4, 80) };
+                params.rotation = fnFloat(-3.0f, 3.0f);
+                params.color = olc::Pixel(uint8_t(fnInt(0, 255)), uint8_t(fnInt(0, 255)), uint8_t(fnInt(0, 255)));
+                const int join = fnInt(0, 9);
+                params.joinOperation = (join == 9) ? JoinOperation::Subtraction : (join == 8) ? JoinOperation::Intersection : JoinOperation::Union;
+                types.push_back(PrimitiveType(fnInt(0, 2)));
+                scene.push_back(params);
+            }
+
+            auto fnBuild = [&](Shaper& shaper)
+            {
+                Layer* layer = shaper.AddLayer();
+                layer->SetEdgeMode(edgeMode);
+                layer->SetMergeSmoothness(smoothness);
+                layer->GetShadingEffect()->mEnabled = shading;
+                layer->GetShadingEffect()->mLightPosition = { 10, 10 };
+                layer->GetContourEffect()->mEnabled = contour;
+                layer->GetContourEffect()->mThickness = thickness;
+
+                std::vector<Element*> elements;
+                for (size_t i = 0; i < scene.size(); i++)
+                {
+                    Element* element = (types[i] == PrimitiveType::Ellipse) ? static_cast<Element*>(new EllipseElement()) :
+                        (types[i] == PrimitiveType::Rectangle) ? static_cast<Element*>(new RectangleElement()) :
+                        static_cast<Element*>(new TriangleElement());
+                    elements.push_back(layer->AddElement(element));
+                    elements.back()->SetParams(scene[i]);
+                }
+                return std::make_pair(layer, elements);
+            };
+
+            // Drag an element around, re-rendering what it covers before and after every step
+            Shaper edited(width, height);
+            auto [layer, elements] = fnBuild(edited);
+            edited.RenderAll();
+
+            const size_t dragged = size_t(fnInt(0, int(scene.size()) - 1));
+            for (int step = 0; step < 3; step++)
+            {
+                const PixelRect oldBounds = layer->GetElementBounds(elements[dragged]);
+                elements[dragged]->SetPosition(elements[dragged]->GetPosition() + olc::vi2d{ fnInt(-15, 15), fnInt(-15, 15) });
+                layer->Invalidate(oldBounds.Union(layer->GetElementBounds(elements[dragged])));
+                edited.RenderAll();
+            }
+            scene[dragged] = elements[dragged]->GetParams();
+
+            Shaper full(width, height);
+            Layer* reference = fnBuild(full).first;
+            full.RenderAll();
+
+            olc::Sprite* a = layer->GetSurface();
+            olc::Sprite* b = reference->GetSurface();
+            for (int i = 0; i < width * height; i++)
+            {
+                if (a->GetData()[i] != b->GetData()[i])
+                {
+                    return "seed " + std::to_string(seed) + (edgeMode == EdgeMode::Coverage ? " with coverage" : "") + ": pixel " +
+                        std::to_string(i % width) + "," + std::to_string(i / width) + " differs from a full render";
+                }
+            }
+        }
+    }
+    return {};
+}
+
+// Hard edged layers are rasterized as spans. A merge smoothness too small to change any sum
+// turns the spans off, so it renders the same shapes pixel by pixel and has to agree exactly.
+static std::string TestSpans()
+{
+    const EdgeMode edgeModes[] = { EdgeMode::Hard, EdgeMode::Coverage };
+    for (EdgeMode edgeMode : edgeModes)
+    {
+        for (unsigned seed = 0; seed < 100; seed++)
+        {
+            std::mt19937 rng(seed);
+            auto fnInt = [&](int lo, int hi) { return std::uniform_int_distribution<int>(lo, hi)(rng); };
+            auto fnFloat = [&](float lo, float hi) { return std::uniform_real_distribution<float>(lo, hi)(rng); };
+
+            const int width = fnInt(40, 240), height = fnInt(40, 240);
+            const bool contour = fnInt(0, 1);
+
+            std::vector<PrimitiveType> types;
+            std::vector<ElementParams> scene;
+            for (int i = fnInt(1, 12); i > 0; i--)
+            {
+                ElementParams params;
+                params.position = { fnInt(0, width), fnInt(0, height) };
+                params.size = { fnInt(2, 120), fnInt(2, 120) };
+                params.rotation = fnFloat(-3.0f, 3.0f);
+                params.color = olc::Pixel(uint8_t(fnInt(0, 255)), uint8_t(fnInt(0, 255)), uint8_t(fnInt(0, 255)));
+                const int join = fnInt(0, 9);
+                params.joinOperation = (join >= 8) ? JoinOperation::Subtraction : (join >= 6) ? JoinOperation::Intersection : JoinOperation::Union;
+                types.push_back(PrimitiveType(fnInt(0, 2)));
+                scene.push_back(params);
+            }
+
+            auto fnRender = [&](float smoothness)
+            {
+                Shaper shaper(width, height);
+                Layer* layer = shaper.AddLayer();
+                layer->SetEdgeMode(edgeMode);
+                layer->SetMergeSmoothness(smoothness);
+                layer->GetContourEffect()->mEnabled = contour;
+                for (size_t i = 0; i < scene.size(); i++)
+                {
+                    Element* element = (types[i] == PrimitiveType::Ellipse) ? static_cast<Element*>(new EllipseElement()) :
+                        (types[i] == PrimitiveType::Rectangle) ? static_cast<Element*>(new RectangleElement()) :
+                        static_cast<Element*>(new TriangleElement());
+                    layer->AddElement(element)->SetParams(scene[i]);
+                }
+                shaper.RenderAll();
+
+                olc::Sprite* surface = layer->GetSurface();
+                return std::vector<olc::Pixel>(surface->GetData(), surface->GetData() + width * height);
+            };
+
+            const std::vector<olc::Pixel> spans = fnRender(0.0f);
+            const std::vector<olc::Pixel> pixels = fnRender(1e-30f);
+            for (int i = 0; i < width * height; i++)
+            {
+                if (spans[size_t(i)] != pixels[size_t(i)])
+                {
+                    return "seed " + std::to_string(seed) + (edgeMode == EdgeMode::Coverage ? " with coverage" : "") + ": pixel " +
+                        std::to_string(i % width) + "," + std::to_string(i / width) + " differs from the per pixel render";
+                }
+            }
+        }
+    }
+    return {};
+}
+
+// The contour comes from a distance transform, it has to draw the same pixels as testing every
+// neighbour within the thickness the way the effect used to
+static std::string TestContour()
+{
+    const EdgeMode edgeModes[] = { EdgeMode::Hard, EdgeMode::Coverage };
+    for (EdgeMode edgeMode : edgeModes)
+    {
+        for (unsigned seed = 0; seed < 40; seed++)
+        {
+            std::mt19937 rng(seed);
+            auto fnInt = [&](int lo, int hi) { return std::uniform_int_distribution<int>(lo, hi)(rng); };
+
+            const int width = fnInt(40, 200), height = fnInt(40, 200);
+            const int thickness = fnInt(1, 12);
+            const olc::Pixel contourColor(uint8_t(fnInt(0, 255)), uint8_t(fnInt(0, 255)), uint8_t(fnInt(0, 255)), uint8_t(fnInt(1, 255)));
+
+            Shaper shaper(width, height);
+            Layer* layer = shaper.AddLayer();
+            layer->SetEdgeMode(edgeMode);
+            layer->SetMergeSmoothness(fnInt(0, 1) ? 0.3f : 0.0f);
+            for (int i = fnInt(1, 8); i > 0; i--)
+            {
+                ElementParams params;
+                params.position = { fnInt(0, width), fnInt(0, height) };
+                params.size = { fnInt(2, 60), fnInt(2, 60) };
+                params.rotation = float(fnInt(0, 628)) / 100.0f;
+                params.color = olc::Pixel(uint8_t(fnInt(0, 255)), uint8_t(fnInt(0, 255)), uint8_t(fnInt(0, 255)));
+                params.joinOperation = (fnInt(0, 5) == 0) ? JoinOperation::Subtraction : JoinOperation::Union;
+                Element* element = (i % 3 == 0) ? static_cast<Element*>(new EllipseElement()) :
+                    (i % 3 == 1) ? static_cast<Element*>(new RectangleElement()) : static_cast<Element*>(new TriangleElement());
+                layer->AddElement(element)->SetParams(params);
+            }
+            shaper.RenderAll();
+
+            olc::Sprite* surface = layer->GetSurface();
+            const std::vector<olc::Pixel> shape(surface->GetData(), surface->GetData() + width * height);
+            const std::vector<float> field = layer->GetDistanceField();
+            auto fnIsOpaque = [&](int x, int y) { return field[size_t(y) * width + x] < 0.0f && shape[size_t(y) * width + x].a != 0; };
+
+            layer->GetContourEffect()->mEnabled = true;
+            layer->GetContourEffect()->mThickness = thickness;
+            layer->GetContourEffect()->mColor = contourColor;
+            layer->Invalidate();
+            shaper.RenderAll();
+
+            for (int y = 0; y < height; y++)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    olc::Pixel expected = shape[size_t(y) * width + x];
+                    if (expected.a == 0 || field[size_t(y) * width + x] >= 0.0f)
+                    {
+                        bool shouldDrawContour = false;
+                        for (int dy = -thickness; dy <= thickness && !shouldDrawContour; dy++)
+                        {
+                            for (int dx = -thickness; dx <= thickness && !shouldDrawContour; dx++)
+                            {
+                                if (dx == 0 && dy == 0) continue;
+                                if (std::sqrt(float(dx * dx + dy * dy)) > float(thickness)) continue;
+                                const int nx = x + dx, ny = y + dy;
+                                shouldDrawContour = nx >= 0 && nx < width && ny >= 0 && ny < height && fnIsOpaque(nx, ny);
+                            }
+                        }
+
+                        if (shouldDrawContour)
+                        {
+                            float alpha = expected.a / 255.0f;
+                            float contourAlpha = contourColor.a / 255.0f * (1.0f - alpha);
+                            float total = alpha + contourAlpha;
+                            auto fnMix = [&](uint8_t a, uint8_t b) { return uint8_t((a * alpha + b * contourAlpha) / total + 0.5f); };
+                            expected = (expected.a == 0) ? contourColor : olc::Pixel(fnMix(expected.r, contourColor.r),
+                                fnMix(expected.g, contourColor.g), fnMix(expected.b, contourColor.b), uint8_t(total * 255.0f + 0.5f));
+                        }
+                    }
+
+                    if (surface->GetPixel(x, y) != expected)
+                    {
+                        return "seed " + std::to_string(seed) + (edgeMode == EdgeMode::Coverage ? " with coverage" : "") + ": pixel " +
+                            std::to_string(x) + "," + std::to_string(y) + " differs from the neighbourhood rule, thickness " + std::to_string(thickness);
+                    }
+                }
+            }
+        }
+    }
+    return {};
+}
+
+// Changing an element through the history re-renders where it was as well as where it goes, on
+// execute as much as on undo
+static std::string TestMoveElement()
+{
+    Shaper shaper(256, 256);
+    Layer* layer = shaper.AddLayer();
+
+    ElementParams params;
+    params.position = { 40, 40 };
+    params.size = { 20, 20 };
+    Element* element = layer->AddElement(new RectangleElement());
+    element->SetParams(params);
+    shaper.RenderAll();
+
+    History history;
+    params.position = { 200, 200 };
+    history.Push(new CmdChangeProperty({ &shaper, layer->GetID(), element->GetID() }, params));
+    shaper.RenderAll();
+
+    olc::Sprite* surface = layer->GetSurface();
+    if (surface->GetPixel(40, 40).a != 0) return "the old area still shows the element after moving it";
+    if (surface->GetPixel(200, 200).a == 0) return "the element is missing where it was moved to";
+
+    history.Undo();
+    shaper.RenderAll();
+    if (surface->GetPixel(200, 200).a != 0) return "the moved area still shows the element after undo";
+    if (surface->GetPixel(40, 40).a == 0) return "the element is missing where undo put it back";
+    return {};
+}
+
+// Pixels a test image is made of: noise, smooth gradients that filter well and long runs
+// Every instruction set the CPU supports has to give the same bits as the scalar kernels, for
+// each kernel on its own and for a whole scene rendered through them
+static std::string TestSimdLevels()
+{
+    const SimdLevel initialLevel = SdfBatch::GetLevel();
+    const int count = 203;
+    const size_t padded = size_t(SdfBatch::PaddedCount(count));
+
+    std::mt19937 rng(7);
+    auto fnValues = [&](float lo, float hi)
+    {
+        std::vector<float> values(padded);
+        for (float& value : values) value = std::uniform_real_distribution<float>(lo, hi)(rng);
+        return values;
+    };
+    const std::vector<float> u = fnValues(-1.5f, 1.5f), v = fnValues(-1.5f, 1.5f), sdf = fnValues(-40.0f, 40.0f),
+        accum = fnValues(-40.0f, 40.0f), gx = fnValues(-1.0f, 1.0f), gy = fnValues(-1.0f, 1.0f), jacobian = fnValues(-0.1f, 0.1f),
+        nz = fnValues(0.0f, 1.0f);
+    std::vector<uint32_t> colors(padded);
+    for (uint32_t& color : colors) color = uint32_t(rng());
+
+    // Runs every kernel at the active level and collects the bits they wrote
+    auto fnRunKernels = [&]()
+    {
+        std::vector<uint32_t> results;
+        auto fnKeep = [&](const std::vector<float>& values)
+        {
+            results.resize(results.size() + size_t(count));
+            std::memcpy(results.data() + results.size() - size_t(count), values.data(), size_t(count) * sizeof(float));
+        };
+
+        std::vector<float> out(padded), outX(padded), outY(padded);
+        for (int type = 0; type < 3; type++)
+        {
+            SdfBatch::Evaluate(PrimitiveType(type), u.data(), v.data(), out.data(), count);
+            fnKeep(out);
+            SdfBatch::EvaluateGradient(PrimitiveType(type), u.data(), v.data(), jacobian.data(), out.data(), outX.data(), outY.data(), count);
+            fnKeep(out);
+            fnKeep(outX);
+            fnKeep(outY);
+        }
+
+        std::vector<float> closest = accum;
+        std::vector<uint32_t> closestColor = colors;
+        SdfBatch::SelectClosest(closest.data(), closestColor.data(), sdf.data(), 0x12345678u, count);
+        fnKeep(closest);
+        results.insert(results.end(), closestColor.begin(), closestColor.begin() + count);
+
+        const float smoothnesses[] = { 0.0f, 0.3f, 12.0f };
+        for (float smoothness : smoothnesses)
+        {
+            out = accum;
+            SdfBatch::Union(out.data(), sdf.data(), smoothness, count);
+            fnKeep(out);
+            out = accum, outX = gx, outY = gy;
+            SdfBatch::Union(out.data(), outX.data(), outY.data(), sdf.data(), gy.data(), gx.data(), smoothness, count);
+            fnKeep(out);
+            fnKeep(outX);
+            fnKeep(outY);
+        }
+        out = accum;
+        SdfBatch::Intersect(out.data(), sdf.data(), count);
+        fnKeep(out);
+        out = accum;
+        SdfBatch::Subtract(out.data(), sdf.data(), count);
+        fnKeep(out);
+        out = accum, outX = gx, outY = gy;
+        SdfBatch::Intersect(out.data(), outX.data(), outY.data(), sdf.data(), gy.data(), gx.data(), count);
+        fnKeep(out);
+        fnKeep(outX);
+        fnKeep(outY);
+        out = accum, outX = gx, outY = gy;
+        SdfBatch::Subtract(out.data(), outX.data(), outY.data(), sdf.data(), gy.data(), gx.data(), count);
+        fnKeep(out);
+        fnKeep(outX);
+        fnKeep(outY);
+
+        SdfBatch::Lighting(gx.data(), gy.data(), nz.data(), accum.data(), 30.0f, 50.0f, out.data(), count);
+        fnKeep(out);
+        return results;
+    };
+
+    // A scene with every primitive, join, effect and edge mode
+    auto fnRenderScene = [&]()
+    {
+        std::vector<olc::Pixel> pixels;
+        const EdgeMode edgeModes[] = { EdgeMode::Hard, EdgeMode::Coverage };
+        for (EdgeMode edgeMode : edgeModes)
+        {
+            Shaper shaper(160, 120);
+            Layer* layer = shaper.AddLayer();
+            layer->SetEdgeMode(edgeMode);
+            layer->SetMergeSmoothness(0.4f);
+            layer->GetShadingEffect()->mEnabled = true;
+            layer->GetContourEffect()->mEnabled = true;
+
+            const JoinOperation joins[] = { JoinOperation::Union, JoinOperation::Union, JoinOperation::Intersection, JoinOperation::Subtraction };
+            for (int i = 0; i < 8; i++)
+            {
+                ElementParams params;
+                params.position = { 20 + i * 17, 30 + (i % 3) * 25 };
+                params.size = { 30 + i * 3, 50 - i * 2 };
+                params.rotation = 0.4f * float(i);
+                params.color = olc::Pixel(uint8_t(i * 30), uint8_t(255 - i * 20), 90);
+                params.joinOperation = joins[i % 4];
+                Element* element = (i % 3 == 0) ? static_cast<Element*>(new EllipseElement()) :
+                    (i % 3 == 1) ? static_cast<Element*>(new RectangleElement()) : static_cast<Element*>(new TriangleElement());
+                layer->AddElement(element)->SetParams(params);
+            }
+            shaper.RenderAll();
+
+            olc::Sprite* surface = layer->GetSurface();
+            pixels.insert(pixels.end(), surface->GetData(), surface->GetData() + surface->width * surface->height);
+        }
+        return pixels;
+    };
+
+    SdfBatch::SetLevel(SimdLevel::Scalar);
+    const std::vector<uint32_t> expectedKernels = fnRunKernels();
+    const std::vector<olc::Pixel> expectedScene = fnRenderScene();
+
+    std::string error;
+    for (int level = int(SimdLevel::SSE2); level <= int(SdfBatch::GetSupportedLevel()) && error.empty(); level++)
+    {
+        SdfBatch::SetLevel(SimdLevel(level));
+        if (fnRunKernels() != expectedKernels)
+        {
+            error = std::string(SdfBatch::GetLevelName(SimdLevel(level))) + " kernels differ from the scalar ones";
+        }
+        else if (fnRenderScene() != expectedScene)
+        {
+            error = std::string(SdfBatch::GetLevelName(SimdLevel(level))) + " renders the scene differently from scalar";
+        }
+    }
+    SdfBatch::SetLevel(initialLevel);
+    return error;
+}
+
+static std::vector<olc::Pixel> MakeTestImage(int width, int height, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    std::vector<olc::Pixel> pixels(size_t(width) * height);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            olc::Pixel& p = pixels[size_t(y) * width + x];
+            switch ((x / 16 + y / 16) % 3)
+            {
+                case 0: p.n = uint32_t(rng()); break;
+                case 1: p = olc::Pixel(uint8_t(x), uint8_t(y), uint8_t(x + y), uint8_t(255 - x)); break;
+                default: p = olc::Pixel(10, 20, 30, (y % 5 == 0) ? 0 : 255); break;
+            }
+        }
+    }
+    return pixels;
+}
+
+#ifdef PIXELSHAPER_ZLIB
+// Reads back an 8 bit RGBA PNG as PngEncoder writes it, empty if anything about it is off
+static std::vector<olc::Pixel> DecodePNG(const std::string& png, int width, int height)
+{
+    const auto* data = reinterpret_cast<const uint8_t*>(png.data());
+    auto fnBigEndian = [&](size_t at) { return uint32_t(data[at]) << 24 | uint32_t(data[at + 1]) << 16 | uint32_t(data[at + 2]) << 8 | data[at + 3]; };
+
+    if (png.size() < 8 || std::memcmp(data, "\x89PNG\r\n\x1a\n", 8) != 0) return {};
+
+    std::vector<uint8_t> compressed;
+    bool ended = false;
+    for (size_t at = 8; at + 12 <= png.size() && !ended; )
+    {
+        const uint32_t length = fnBigEndian(at);
+        if (at + 12 + length > png.size()) return {};
+        if (fnBigEndian(at + 8 + length) != uint32_t(crc32(0, data + at + 4, uInt(length + 4)))) return {};
+
+        const std::string type(png, at + 4, 4);
+        if (type == "IHDR" && (fnBigEndian(at + 8) != uint32_t(width) || fnBigEndian(at + 12) != uint32_t(height))) return {};
+        if (type == "IDAT") compressed.insert(compressed.end(), data + at + 8, data + at + 8 + length);
+        ended = type == "IEND";
+        at += 12 + length;
+    }
+    if (!ended) return {};
+
+    const size_t rowBytes = size_t(width) * 4;
+    std::vector<uint8_t> filtered(height * (rowBytes + 1));
+    uLongf size = uLongf(filtered.size());
+    if (uncompress(filtered.data(), &size, compressed.data(), uLong(compressed.size())) != Z_OK || size != filtered.size()) return {};
+
+    std::vector<olc::Pixel> pixels(size_t(width) * height);
+    auto* out = reinterpret_cast<uint8_t*>(pixels.data());
+    for (int y = 0; y < height; y++)
+    {
+        const uint8_t* in = filtered.data() + y * (rowBytes + 1);
+        uint8_t* row = out + y * rowBytes;
+        const uint8_t* previous = (y > 0) ? row - rowBytes : nullptr;
+        for (size_t i = 0; i < rowBytes; i++)
+        {
+            const int a = (i >= 4) ? row[i - 4] : 0;
+            const int b = previous ? previous[i] : 0;
+            const int c = (i >= 4 && previous) ? previous[i - 4] : 0;
+            int predicted = 0;
+            switch (in[0])
+            {
+                case 0: predicted = 0; break;
+                case 1: predicted = a; break;
+                case 2: predicted = b; break;
+                case 3: predicted = (a + b) / 2; break;
+                case 4:
+                {
+                    const int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                    predicted = (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+                    break;
+                }
+                default: return {};
+            }
+            row[i] = uint8_t(in[1 + i] + predicted);
+        }
+    }
+    return pixels;
+}
+
+// PNGs decode to the pixels they were written from, at every level and however the rows arrive,
+// and the rows arriving in pieces or at once give the same file
+static std::string TestPngRoundTrip()
+{
+    ThreadPool workers(3);
+    const int sizes[][2] = { { 1, 1 }, { 7, 300 }, { 333, 97 }, { 5000, 40 } };
+    for (const auto& size : sizes)
+    {
+        const int width = size[0], height = size[1];
+        const std::vector<olc::Pixel> pixels = MakeTestImage(width, height, unsigned(width));
+        for (int level : { 0, 1, 6, 9 })
+        {
+            std::ostringstream whole, pieces;
+            PngEncoder wholeEncoder(whole, width, height, level, &workers);
+            if (!wholeEncoder.WriteRows(pixels.data(), height) || !wholeEncoder.Finish()) return "writing failed";
+
+            PngEncoder piecesEncoder(pieces, width, height, level);
+            for (int y = 0, count = 0; y < height; y += count, count = (count * 7 + 3) % 50)
+            {
+                count = std::min(count, height - y);
+                if (!piecesEncoder.WriteRows(pixels.data() + size_t(y) * width, count)) return "writing rows failed";
+            }
+            if (!piecesEncoder.Finish()) return "writing failed";
+
+            const std::string what = std::to_string(width) + "x" + std::to_string(height) + " at level " + std::to_string(level);
+            if (whole.str() != pieces.str()) return "rows in pieces give another file for " + what;
+            if (DecodePNG(whole.str(), width, height) != pixels) return "decoding gives other pixels for " + what;
+        }
+    }
+    return {};
+}
+#endif
+
+// Reads back a QOI image following the format's specification, empty if it is malformed
+static std::vector<olc::Pixel> DecodeQOI(const std::string& qoi, int width, int height)
+{
+    const auto* data = reinterpret_cast<const uint8_t*>(qoi.data());
+    auto fnBigEndian = [&](size_t at) { return uint32_t(data[at]) << 24 | uint32_t(data[at + 1]) << 16 | uint32_t(data[at + 2]) << 8 | data[at + 3]; };
+
+    if (qoi.size() < 22 || qoi.compare(0, 4, "qoif") != 0) return {};
+    if (fnBigEndian(4) != uint32_t(width) || fnBigEndian(8) != uint32_t(height)) return {};
+    if (qoi.compare(qoi.size() - 8, 8, std::string("\0\0\0\0\0\0\0\1", 8)) != 0) return {};
+
+    std::vector<olc::Pixel> pixels;
+    olc::Pixel index[64];
+    std::fill_n(index, 64, olc::Pixel(0, 0, 0, 0));
+    olc::Pixel p(0, 0, 0, 255);
+
+    const size_t end = qoi.size() - 8;
+    for (size_t at = 14; at < end; )
+    {
+        const uint8_t tag = data[at++];
+        int run = 1;
+        if (tag == 0xfe) { p.r = data[at]; p.g = data[at + 1]; p.b = data[at + 2]; at += 3; }
+        else if (tag == 0xff) { p = olc::Pixel(data[at], data[at + 1], data[at + 2], data[at + 3]); at += 4; }
+        else if ((tag >> 6) == 0) p = index[tag];
+        else if ((tag >> 6) == 1)
+        {
+            p.r = uint8_t(p.r + ((tag >> 4) & 3) - 2);
+            p.g = uint8_t(p.g + ((tag >> 2) & 3) - 2);
+            p.b = uint8_t(p.b + (tag & 3) - 2);
+        }
+        else if ((tag >> 6) == 2)
+        {
+            const int dg = (tag & 63) - 32;
+            const uint8_t next = data[at++];
+            p.r = uint8_t(p.r + dg + (next >> 4) - 8);
+            p.g = uint8_t(p.g + dg);
+            p.b = uint8_t(p.b + dg + (next & 15) - 8);
+        }
+        else run = (tag & 63) + 1;
+
+        index[(p.r * 3 + p.g * 5 + p.b * 7 + p.a * 11) % 64] = p;
+        pixels.insert(pixels.end(), run, p);
+    }
+    if (pixels.size() != size_t(width) * height) return {};
+    return pixels;
+}
+
+// QOI, PAM and raw exports read back to the pixels they were written from
+static std::string TestImageRoundTrip()
+{
+    const int sizes[][2] = { { 1, 1 }, { 3, 200 }, { 257, 61 } };
+    for (const auto& size : sizes)
+    {
+        const int width = size[0], height = size[1];
+        const std::vector<olc::Pixel> pixels = MakeTestImage(width, height, unsigned(height));
+        const std::string what = " of " + std::to_string(width) + "x" + std::to_string(height);
+
+        for (ImageFormat format : { ImageFormat::QOI, ImageFormat::PAM, ImageFormat::Raw })
+        {
+            std::ostringstream out;
+            auto writer = ImageWriter::Create(format, out, width, height, 0);
+            for (int y = 0; y < height; y += 16)
+            {
+                if (!writer->WriteRows(pixels.data() + size_t(y) * width, std::min(16, height - y))) return "writing rows failed";
+            }
+            if (!writer->Finish()) return "writing failed";
+
+            const std::string file = out.str();
+            std::vector<olc::Pixel> decoded;
+            if (format == ImageFormat::QOI)
+            {
+                decoded = DecodeQOI(file, width, height);
+            }
+            else
+            {
+                const std::string header = (format == ImageFormat::Raw) ? std::string() :
+                    "P7\nWIDTH " + std::to_string(width) + "\nHEIGHT " + std::to_string(height) +
+                    "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+                if (file.compare(0, header.size(), header) != 0) return "wrong PAM header" + what;
+                if (file.size() == header.size() + pixels.size() * 4)
+                {
+                    decoded.resize(pixels.size());
+                    std::memcpy(decoded.data(), file.data() + header.size(), pixels.size() * 4);
+                }
+            }
+
+            const char* name = (format == ImageFormat::QOI) ? "QOI" : (format == ImageFormat::PAM) ? "PAM" : "raw";
+            if (decoded != pixels) return std::string(name) + " decodes to other pixels" + what;
+        }
+    }
+    return {};
+}
+
+// The SIMD blends give the same bytes as the scalar formula, dst = src + dst * (255 - src.a) / 255
+// rounded to nearest, at every length and alignment
+static std::string TestCompositor()
+{
+    auto fnDiv255 = [](uint32_t x) { return (x + 127) / 255; };
+
+    std::mt19937 rng(22);
+    for (int round = 0; round < 200; round++)
+    {
+        const int count = round % 37, offset = round % 3;
+        std::vector<olc::Pixel> target(count + offset), source(count + offset);
+        for (int i = 0; i < count + offset; i++)
+        {
+            target[i].n = uint32_t(rng());
+            source[i].n = uint32_t(rng());
+            if (rng() % 4 == 0) source[i].a = (rng() % 2) ? 0 : 255;
+        }
+
+        for (bool premultiplied : { false, true })
+        {
+            // Premultiplied colors never exceed their alpha
+            if (premultiplied)
+            {
+                for (olc::Pixel& p : source)
+                {
+                    p = olc::Pixel(uint8_t(fnDiv255(p.r * p.a)), uint8_t(fnDiv255(p.g * p.a)), uint8_t(fnDiv255(p.b * p.a)), p.a);
+                }
+            }
+
+            std::vector<olc::Pixel> blended = target;
+            if (premultiplied)
+            {
+                Compositor::BlendOverPremultiplied(blended.data() + offset, source.data() + offset, count);
+            }
+            else
+            {
+                Compositor::BlendOver(blended.data() + offset, source.data() + offset, count);
+            }
+
+            for (int i = offset; i < count + offset; i++)
+            {
+                olc::Pixel src = source[i], dst = target[i];
+                if (src.a == 0) continue;
+                if (!premultiplied)
+                {
+                    src = olc::Pixel(uint8_t(fnDiv255(src.r * src.a)), uint8_t(fnDiv255(src.g * src.a)), uint8_t(fnDiv255(src.b * src.a)), src.a);
+                }
+                const uint32_t inverse = 255 - src.a;
+                const olc::Pixel expected(
+                    uint8_t(src.r + fnDiv255(dst.r * inverse)), uint8_t(src.g + fnDiv255(dst.g * inverse)),
+                    uint8_t(src.b + fnDiv255(dst.b * inverse)), uint8_t(src.a + fnDiv255(dst.a * inverse)));
+                if (blended[i] != expected)
+                {
+                    return std::string(premultiplied ? "premultiplied" : "straight") + " blend of pixel " + std::to_string(i - offset) +
+                        " of " + std::to_string(count) + " differs from the scalar formula";
+                }
+            }
+        }
+    }
+    return {};
+}
+
+int main()
+{
+    const std::vector<std::pair<const char*, std::function<std::string()>>> tests = {
+        { "culled intersection", TestCulledIntersection },
+        { "partial render", TestPartialRender },
+        { "spans", TestSpans },
+        { "contour", TestContour },
+        { "move element", TestMoveElement },
+        { "SIMD levels", TestSimdLevels },
+        { "compositor", TestCompositor },
+        { "QOI, PAM and raw round trip", TestImageRoundTrip },
+#ifdef PIXELSHAPER_ZLIB
+        { "PNG round trip", TestPngRoundTrip },
+#endif
+    };
+
+    int failed = 0;
+    for (const auto& [name, test] : tests)
+    {
+        const std::string error = test();
+        if (error.empty())
+        {
+            std::printf("passed: %s\n", name);
+        }
+        else
+        {
+            std::printf("FAILED: %s: %s\n", name, error.c_str());
+            failed++;
+        }
+    }
+    return failed == 0 ? 0 : 1;
+}